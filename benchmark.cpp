@@ -0,0 +1,994 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifdef WIN32
+#pragma warning(disable:4530)
+#define WIN32_CONSOLE
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio> // std::remove
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "pointcloud.h"
+#include "point.h"
+#include "compressedcloud.h"
+#include "datasets.h"
+#include "querylog.h"
+#include "querycounters.h"
+
+// Counts hardware events of the calling thread and the threads it starts with
+// perf_event_open(), each event with its own counter. Events the CPU, kernel
+// or permissions do not support are reported as n/a. If the kernel
+// multiplexes the counters, the counts are scaled to the full measurement
+// time.
+class PerfCounters
+{
+public:
+	enum Event { Cycles, Instructions, L1Misses, LlcMisses, TlbMisses, BranchMisses, EventCount };
+
+	PerfCounters()
+	{
+#ifdef __linux__
+		auto cache = [](uint64_t cache) {
+			return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		};
+		open(Cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		open(Instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		open(L1Misses, PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D));
+		open(LlcMisses, PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL));
+		open(TlbMisses, PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_DTLB));
+		open(BranchMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+	}
+
+	~PerfCounters()
+	{
+#ifdef __linux__
+		for (int fd : m_fd) {
+			if (fd >= 0) close(fd);
+		}
+#endif
+	}
+
+	bool valid(Event event) const { return m_fd[event] >= 0; }
+
+	void start()
+	{
+#ifdef __linux__
+		for (int fd : m_fd) {
+			if (fd < 0) continue;
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	void stop()
+	{
+#ifdef __linux__
+		for (int e = 0; e < EventCount; ++e)
+		{
+			m_count[e] = 0;
+			if (m_fd[e] < 0) continue;
+			ioctl(m_fd[e], PERF_EVENT_IOC_DISABLE, 0);
+
+			// value, time enabled, time running
+			uint64_t values[3];
+			if (read(m_fd[e], values, sizeof(values)) == sizeof(values) && values[2] > 0) {
+				m_count[e] = static_cast<double>(values[0]) * values[1] / values[2];
+			}
+		}
+#endif
+	}
+
+	// Returns the count of @p event between start() and stop().
+	double count(Event event) const { return m_count[event]; }
+
+	// Returns the counts divided by @p n, e.g. the amount of queries, as text.
+	std::string perItem(uint64_t n) const
+	{
+		static const char* names[EventCount] = {"cycles", "instructions", "L1D misses", "LLC misses", "dTLB misses", "branch misses"};
+
+		if (std::none_of(m_fd, m_fd + EventCount, [](int fd) { return fd >= 0; })) {
+			return "n/a, no perf_event access";
+		}
+
+		std::string text;
+		for (int e = 0; e < EventCount; ++e)
+		{
+			text += std::string(e ? ", " : "") + names[e] + " ";
+			text += valid(static_cast<Event>(e)) ? std::to_string(m_count[e] / n) : "n/a";
+		}
+		if (valid(Cycles) && valid(Instructions) && m_count[Cycles] > 0) {
+			text += ", IPC " + std::to_string(m_count[Instructions] / m_count[Cycles]);
+		}
+		return text;
+	}
+
+private:
+#ifdef __linux__
+	void open(Event event, uint32_t type, uint64_t config)
+	{
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1; // count threads started during the measurement, e.g. by refit()
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		m_fd[event] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+#endif
+
+	int m_fd[EventCount] = {-1, -1, -1, -1, -1, -1};
+	double m_count[EventCount] = {};
+};
+
+// Returns the leaves and points the calling thread scanned per item of @p n
+// since the counters were @p before, see kdtree::QueryCounters.
+static std::string scannedPerItem(const kdtree::QueryCounters& before, uint64_t n)
+{
+#ifdef KDTREE_QUERY_COUNTERS
+	const kdtree::QueryCounters& after = kdtree::queryCounters();
+	std::ostringstream text;
+	text << static_cast<double>(after.leaves - before.leaves) / n << " leaves, "
+		 << static_cast<double>(after.points - before.points) / n << " points";
+	return text.str();
+#else
+	(void)before;
+	(void)n;
+	return "n/a, build with KDTREE_QUERY_COUNTERS";
+#endif
+}
+
+// Build the tree and run the queries once, report time and hardware counters.
+template <class Alloc>
+static void runHugePages(const char* name, const std::vector<kdtree::Point>& points,
+						 const std::vector<float>& queries, unsigned int k, bool hugePages)
+{
+	const uint64_t numQueries = queries.size() / 3;
+
+	kdtree::PointCloud<kdtree::Point, Alloc> pointCloud;
+	pointCloud.setItems(points);
+	pointCloud.setHugePages(hugePages);
+
+	PerfCounters counters;
+	counters.start();
+	auto start = std::chrono::steady_clock::now();
+	pointCloud.rebuildTree();
+	const double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	counters.stop();
+	const std::string buildCounters = counters.perItem(points.size());
+
+	std::vector<kdtree::Point> result;
+	counters.start();
+	start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < numQueries; ++i) {
+		pointCloud.findKNearest(&queries[3 * i], k, result);
+	}
+	const double queryTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	counters.stop();
+
+	std::cout << name
+			  << "build " << buildTime << " s, "
+			  << "query " << 1e9 * queryTime / numQueries << " ns" << std::endl
+			  << "  build per point: " << buildCounters << std::endl
+			  << "  per query: " << counters.perItem(numQueries) << std::endl;
+}
+
+// Random k-nearest queries on a large uniform cloud, with and without huge pages.
+static void benchmarkHugePages(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+
+	std::vector<kdtree::Point> points;
+	points.reserve(numPoints);
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		points.push_back(kdtree::Point(coord(rng), coord(rng), coord(rng)));
+	}
+
+	std::vector<float> queries(3 * numQueries);
+	for (float& q : queries) {
+		q = coord(rng);
+	}
+
+	runHugePages<std::allocator<kdtree::Point>>("regular pages:        ", points, queries, k, false);
+	runHugePages<std::allocator<kdtree::Point>>("huge pages (advised): ", points, queries, k, true);
+	runHugePages<kdtree::HugePageAllocator<kdtree::Point>>("huge pages (alloc):   ", points, queries, k, true);
+}
+
+// Build the tree and run the queries once with the point type T.
+template <class T>
+static void runPointType(const char* name, const std::vector<float>& coords,
+						 const std::vector<float>& queries, unsigned int k)
+{
+	const uint64_t numQueries = queries.size() / 3;
+
+	std::vector<T> points;
+	points.reserve(coords.size() / 3);
+	for (uint64_t i = 0; i < coords.size(); i += 3) {
+		points.push_back(T(coords[i], coords[i + 1], coords[i + 2]));
+	}
+
+	kdtree::PointCloud<T> pointCloud;
+	pointCloud.setItems(std::move(points));
+	pointCloud.rebuildTree();
+
+	std::vector<T> result;
+	std::vector<float> distances;
+	PerfCounters counters;
+	counters.start();
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < numQueries; ++i) {
+		pointCloud.findKNearest(&queries[3 * i], k, result, distances);
+	}
+	const double queryTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	counters.stop();
+
+	std::cout << name
+			  << sizeof(T) << " bytes/point, "
+			  << "query " << 1e9 * queryTime / numQueries << " ns" << std::endl
+			  << "  per query: " << counters.perItem(numQueries) << std::endl;
+}
+
+// Random k-nearest queries with points that cache their distance and slim points.
+static void benchmarkPointTypes(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+
+	std::vector<float> coords(3 * numPoints);
+	for (float& c : coords) {
+		c = coord(rng);
+	}
+
+	std::vector<float> queries(3 * numQueries);
+	for (float& q : queries) {
+		q = coord(rng);
+	}
+
+	runPointType<kdtree::Point>("Point:     ", coords, queries, k);
+	runPointType<kdtree::SlimPoint>("SlimPoint: ", coords, queries, k);
+}
+
+// Run findKNearest and findInRadius on @p cloud, a PointCloud or a
+// CompressedPointCloud, that uses @p bytes of memory for its nodes and points.
+template <class Cloud>
+static void runCompressed(const char* name, const Cloud& cloud, uint64_t bytes, uint64_t numPoints,
+						  const std::vector<float>& queries, unsigned int k, float radius2)
+{
+	const uint64_t numQueries = queries.size() / 3;
+
+	std::vector<kdtree::Point> result;
+	std::vector<float> distances;
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < numQueries; ++i) {
+		cloud.findKNearest(&queries[3 * i], k, result, distances);
+	}
+	const double kNearestTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < numQueries; ++i) {
+		cloud.findInRadius(&queries[3 * i], radius2, result, distances);
+	}
+	const double inRadiusTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << name
+			  << static_cast<double>(bytes) / numPoints << " bytes/point, "
+			  << "findKNearest " << numQueries / kNearestTime << " queries/s, "
+			  << "findInRadius " << numQueries / inRadiusTime << " queries/s" << std::endl;
+}
+
+// Memory and query throughput of the quantized CompressedPointCloud next to
+// a PointCloud of the same points. The bytes of the PointCloud include its
+// nodes, but not the overhead of the heap per node.
+static void benchmarkCompressed(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+
+	std::vector<kdtree::Point> points;
+	points.reserve(numPoints);
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		points.push_back(kdtree::Point(coord(rng), coord(rng), coord(rng)));
+	}
+
+	std::vector<float> queries(3 * numQueries);
+	for (float& q : queries) {
+		q = coord(rng);
+	}
+
+	// about k points per sphere
+	const float radius = std::cbrt(3.0f * k / (4.0f * 3.14159265f * numPoints)) * 1000.0f;
+
+	kdtree::CompressedPointCloud<kdtree::Point> compressed;
+	compressed.setItems(points);
+
+	kdtree::PointCloud<kdtree::Point> pointCloud;
+	pointCloud.setItems(std::move(points));
+	pointCloud.rebuildTree();
+	std::vector<kdtree::FlatNode> nodes;
+	pointCloud.flatten(nodes);
+	const uint64_t bytes = pointCloud.points().capacity() * sizeof(kdtree::Point)
+						 + nodes.size() * sizeof(kdtree::Node<kdtree::Point>);
+
+	runCompressed("PointCloud:           ", pointCloud, bytes, numPoints, queries, k, radius * radius);
+	runCompressed("CompressedPointCloud: ", compressed, compressed.memoryUsage(), numPoints, queries, k, radius * radius);
+}
+
+// Nearest neighbors (k = 1) of coherent and random queries: one query at a
+// time versus packets of queries traversing the tree together.
+static void benchmarkPacketNearest(uint64_t numPoints, uint64_t numQueries)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+	std::normal_distribution<float> noise(0.0f, 1.0f);
+
+	kdtree::PointCloud<kdtree::Point> pointCloud;
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		pointCloud.addItem(kdtree::Point(coord(rng), coord(rng), coord(rng)));
+	}
+	pointCloud.rebuildTree();
+
+	// coherent queries follow a random walk, like the points of a scan
+	std::vector<float> coherent(3 * numQueries);
+	std::vector<float> random(3 * numQueries);
+	float walk[3] = {500.0f, 500.0f, 500.0f};
+	for (uint64_t i = 0; i < numQueries; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			walk[j] = std::min(std::max(walk[j] + noise(rng), 0.0f), 1000.0f);
+			coherent[3 * i + j] = walk[j];
+			random[3 * i + j] = coord(rng);
+		}
+	}
+
+	for (const std::vector<float>* queries : {&coherent, &random})
+	{
+		std::vector<kdtree::Point> result;
+		PerfCounters counters;
+		counters.start();
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < numQueries; ++i) {
+			pointCloud.findKNearest(&(*queries)[3 * i], 1, result);
+		}
+		const double singleTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+		const std::string singleCounters = counters.perItem(numQueries);
+
+		counters.start();
+		start = std::chrono::steady_clock::now();
+		pointCloud.findNearest(queries->data(), numQueries, result);
+		const double packetTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+
+		std::cout << (queries == &coherent ? "k = 1, coherent: " : "k = 1, random:   ")
+				  << "single " << 1e9 * singleTime / numQueries << " ns, "
+				  << "packet " << 1e9 * packetTime / numQueries << " ns" << std::endl
+				  << "  single per query: " << singleCounters << std::endl
+				  << "  packet per query: " << counters.perItem(numQueries) << std::endl;
+	}
+}
+
+// anyWithinRadius of coherent and random queries: one query at a time versus
+// the batch, which tests the point found for the previous query first. Radii
+// are given relative to the mean point spacing, from mostly misses to hits.
+static void benchmarkAnyWithinRadius(uint64_t numPoints, uint64_t numQueries)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+	std::normal_distribution<float> noise(0.0f, 1.0f);
+
+	kdtree::PointCloud<kdtree::Point> pointCloud;
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		pointCloud.addItem(kdtree::Point(coord(rng), coord(rng), coord(rng)));
+	}
+	pointCloud.rebuildTree();
+
+	// coherent queries follow a random walk, like samples along a path
+	std::vector<float> coherent(3 * numQueries);
+	std::vector<float> random(3 * numQueries);
+	float walk[3] = {500.0f, 500.0f, 500.0f};
+	for (uint64_t i = 0; i < numQueries; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			walk[j] = std::min(std::max(walk[j] + noise(rng), 0.0f), 1000.0f);
+			coherent[3 * i + j] = walk[j];
+			random[3 * i + j] = coord(rng);
+		}
+	}
+
+	const float spacing = 1000.0f / std::cbrt(static_cast<float>(numPoints));
+	for (float factor : {0.3f, 1.0f, 3.0f})
+	{
+		const float radius2 = factor * spacing * factor * spacing;
+		for (const std::vector<float>* queries : {&coherent, &random})
+		{
+			uint64_t hits = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (uint64_t i = 0; i < numQueries; ++i) {
+				hits += pointCloud.anyWithinRadius(&(*queries)[3 * i], radius2);
+			}
+			const double singleTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			std::vector<bool> batchHits;
+			start = std::chrono::steady_clock::now();
+			pointCloud.anyWithinRadius(queries->data(), numQueries, radius2, batchHits);
+			const double batchTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			std::cout << "anyWithinRadius, radius " << factor << " x spacing, "
+					  << (queries == &coherent ? "coherent: " : "random:   ")
+					  << 100.0 * hits / numQueries << "% hits, "
+					  << "single " << 1e9 * singleTime / numQueries << " ns, "
+					  << "batch " << 1e9 * batchTime / numQueries << " ns" << std::endl;
+		}
+	}
+}
+
+// Points that jitter each frame, like particles: refit() versus rebuildTree().
+static void benchmarkRefit(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+	std::normal_distribution<float> noise(0.0f, 0.5f);
+
+	kdtree::PointCloud<kdtree::SlimPoint> pointCloud;
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		pointCloud.addItem(kdtree::SlimPoint(coord(rng), coord(rng), coord(rng)));
+	}
+	pointCloud.rebuildTree();
+
+	std::vector<float> queries(3 * numQueries);
+	for (float& q : queries) {
+		q = coord(rng);
+	}
+
+	PerfCounters counters;
+	auto queryTime = [&]() {
+		std::vector<kdtree::SlimPoint> result;
+		counters.start();
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < numQueries; ++i) {
+			pointCloud.findKNearest(&queries[3 * i], k, result);
+		}
+		const double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+		return time;
+	};
+
+	// refit only, so that the tree degrades over the frames
+	for (int frame = 1; frame <= 5; ++frame)
+	{
+		kdtree::SlimPoint* points = pointCloud.pointData();
+		for (uint64_t i = 0; i < numPoints; ++i) {
+			points[i].p[0] += noise(rng);
+			points[i].p[1] += noise(rng);
+			points[i].p[2] += noise(rng);
+		}
+
+		float degradation;
+		counters.start();
+		auto start = std::chrono::steady_clock::now();
+		pointCloud.refit(degradation);
+		const double refitTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+		const std::string refitCounters = counters.perItem(numPoints);
+
+		std::cout << "frame " << frame << ": refit " << refitTime << " s, "
+				  << "degradation " << degradation << ", "
+				  << "query " << 1e9 * queryTime() / numQueries << " ns" << std::endl
+				  << "  refit per point: " << refitCounters << std::endl
+				  << "  per query: " << counters.perItem(numQueries) << std::endl;
+	}
+
+	counters.start();
+	auto start = std::chrono::steady_clock::now();
+	pointCloud.rebuildTree();
+	const double rebuildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	counters.stop();
+	const std::string rebuildCounters = counters.perItem(numPoints);
+
+	std::cout << "rebuild " << rebuildTime << " s, "
+			  << "query " << 1e9 * queryTime() / numQueries << " ns" << std::endl
+			  << "  rebuild per point: " << rebuildCounters << std::endl
+			  << "  per query: " << counters.perItem(numQueries) << std::endl;
+}
+
+// A few hundred queries in a small region of the cloud: full versus lazy build.
+static void benchmarkLazyBuild(uint64_t numPoints, unsigned int k)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+	std::uniform_real_distribution<float> region(400.0f, 450.0f);
+
+	std::vector<kdtree::SlimPoint> points;
+	points.reserve(numPoints);
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		points.push_back(kdtree::SlimPoint(coord(rng), coord(rng), coord(rng)));
+	}
+
+	std::vector<float> queries(3 * 300);
+	for (float& q : queries) {
+		q = region(rng);
+	}
+
+	for (bool lazy : {false, true})
+	{
+		kdtree::PointCloud<kdtree::SlimPoint> pointCloud;
+		pointCloud.setItems(points);
+		pointCloud.setLazyBuild(lazy);
+
+		PerfCounters counters;
+		counters.start();
+		auto start = std::chrono::steady_clock::now();
+		pointCloud.rebuildTree();
+		const double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+		const std::string buildCounters = counters.perItem(numPoints);
+
+		std::vector<kdtree::SlimPoint> result;
+		counters.start();
+		start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < queries.size() / 3; ++i) {
+			pointCloud.findKNearest(&queries[3 * i], k, result);
+		}
+		const double queryTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+
+		std::cout << (lazy ? "lazy build: " : "full build: ")
+				  << "build " << buildTime << " s, "
+				  << "300 queries " << queryTime << " s, "
+				  << "total " << buildTime + queryTime << " s" << std::endl
+				  << "  build per point: " << buildCounters << std::endl
+				  << "  per query: " << counters.perItem(queries.size() / 3) << std::endl;
+	}
+}
+
+// Queries along a path, like a vehicle driving through a scan: plain build
+// versus a build for a sample of these queries.
+static void benchmarkQuerySample(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+	std::normal_distribution<float> step(0.0f, 3.0f);
+	std::normal_distribution<float> noise(0.0f, 5.0f);
+
+	std::vector<kdtree::SlimPoint> points;
+	points.reserve(numPoints);
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		points.push_back(kdtree::SlimPoint(coord(rng), coord(rng), coord(rng)));
+	}
+
+	std::vector<float> queries(3 * numQueries);
+	float walk[3] = {500.0f, 500.0f, 500.0f};
+	for (uint64_t i = 0; i < numQueries; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			walk[j] = std::min(std::max(walk[j] + step(rng), 0.0f), 1000.0f);
+			queries[3 * i + j] = walk[j] + noise(rng);
+		}
+	}
+
+	// every 10th query, as if recorded in production
+	std::vector<float> sample;
+	for (uint64_t i = 0; i < numQueries; i += 10) {
+		sample.insert(sample.end(), &queries[3 * i], &queries[3 * i + 3]);
+	}
+
+	for (bool sampled : {false, true})
+	{
+		kdtree::PointCloud<kdtree::SlimPoint> pointCloud;
+		pointCloud.setItems(points);
+		if (sampled) {
+			pointCloud.rebuildTree(sample.data(), sample.size() / 3);
+		} else {
+			pointCloud.rebuildTree();
+		}
+
+		std::vector<kdtree::FlatNode> nodes;
+		pointCloud.flatten(nodes);
+
+		std::vector<kdtree::SlimPoint> result;
+		const kdtree::QueryCounters before = kdtree::queryCounters();
+		PerfCounters counters;
+		counters.start();
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < numQueries; ++i) {
+			pointCloud.findKNearest(&queries[3 * i], k, result);
+		}
+		const double queryTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+
+		std::cout << (sampled ? "sampled build: " : "plain build:   ")
+				  << nodes.size() << " nodes, "
+				  << "query " << 1e9 * queryTime / numQueries << " ns" << std::endl
+				  << "  per query: " << counters.perItem(numQueries) << std::endl
+				  << "  scanned per query: " << scannedPerItem(before, numQueries) << std::endl;
+	}
+}
+
+// k-nearest and radius queries with and without a QueryRecorder, which
+// writes the parameters of every query to a log file.
+static void benchmarkQueryRecorder(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> coord(0.0f, 1000.0f);
+
+	std::vector<kdtree::SlimPoint> points;
+	points.reserve(numPoints);
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		points.push_back(kdtree::SlimPoint(coord(rng), coord(rng), coord(rng)));
+	}
+
+	std::vector<float> queries(3 * numQueries);
+	for (float& q : queries) {
+		q = coord(rng);
+	}
+
+	kdtree::PointCloud<kdtree::SlimPoint> pointCloud;
+	pointCloud.setItems(std::move(points));
+	pointCloud.rebuildTree();
+
+	// about k points per sphere
+	const float radius = std::cbrt(3.0f * k / (4.0f * 3.14159265f * numPoints)) * 1000.0f;
+
+	const std::string fileName = "benchmark-queries.log";
+	for (bool recording : {false, true})
+	{
+		kdtree::QueryRecorder recorder;
+		if (recording) {
+			if (!recorder.open(fileName)) {
+				std::cout << "recorder on:  cannot write " << fileName << std::endl;
+				break;
+			}
+			pointCloud.setQueryRecorder(&recorder);
+		}
+
+		std::vector<kdtree::SlimPoint> result;
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < numQueries; ++i) {
+			pointCloud.findKNearest(&queries[3 * i], k, result);
+		}
+		const double kNearestTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < numQueries; ++i) {
+			pointCloud.findInRadius(&queries[3 * i], radius * radius, result);
+		}
+		const double inRadiusTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		pointCloud.setQueryRecorder(nullptr);
+		const uint64_t recorded = recorder.count();
+		recorder.close();
+
+		std::cout << (recording ? "recorder on:  " : "recorder off: ")
+				  << "findKNearest " << 1e9 * kNearestTime / numQueries << " ns, "
+				  << "findInRadius " << 1e9 * inRadiusTime / numQueries << " ns";
+		if (recording) {
+			std::cout << ", " << recorded << " queries recorded";
+		}
+		std::cout << std::endl;
+	}
+	std::remove(fileName.c_str());
+}
+
+// Build and k-nearest queries for each synthetic distribution, the queries
+// are drawn from the same distribution with another seed.
+static void benchmarkDistributions(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	for (uint32_t d = 0; d < static_cast<uint32_t>(kdtree::Distribution::DistributionCount); ++d)
+	{
+		const kdtree::Distribution distribution = static_cast<kdtree::Distribution>(d);
+
+		std::vector<float> coords(3 * numPoints);
+		kdtree::DatasetGenerator(distribution, numPoints, 42).generate(0, numPoints, coords.data());
+
+		std::vector<float> queries(3 * numQueries);
+		kdtree::DatasetGenerator(distribution, numQueries, 43).generate(0, numQueries, queries.data());
+
+		std::vector<kdtree::SlimPoint> points;
+		points.reserve(numPoints);
+		for (uint64_t i = 0; i < coords.size(); i += 3) {
+			points.push_back(kdtree::SlimPoint(coords[i], coords[i + 1], coords[i + 2]));
+		}
+
+		kdtree::PointCloud<kdtree::SlimPoint> pointCloud;
+		pointCloud.setItems(std::move(points));
+
+		PerfCounters buildCounters;
+		buildCounters.start();
+		auto start = std::chrono::steady_clock::now();
+		pointCloud.rebuildTree();
+		const double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		buildCounters.stop();
+
+		std::vector<kdtree::SlimPoint> result;
+		PerfCounters counters;
+		counters.start();
+		start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < numQueries; ++i) {
+			pointCloud.findKNearest(&queries[3 * i], k, result);
+		}
+		const double queryTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		counters.stop();
+
+		std::cout << kdtree::distributionName(distribution) << ": "
+				  << "build " << buildTime << " s, "
+				  << "query " << 1e9 * queryTime / numQueries << " ns" << std::endl
+				  << "  build per point: " << buildCounters.perItem(numPoints) << std::endl
+				  << "  per query: " << counters.perItem(numQueries) << std::endl;
+	}
+}
+
+// Returns the cpus of each NUMA node, or one node with no cpus if the
+// topology is unknown (then threads are not pinned).
+static std::vector<std::vector<int>> numaNodes()
+{
+	std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+	for (int node = 0; ; ++node)
+	{
+		std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string list;
+		if (!std::getline(file, list)) {
+			break;
+		}
+
+		// e.g. "0-15,32-47"
+		std::vector<int> cpus;
+		std::stringstream ranges(list);
+		std::string range;
+		while (std::getline(ranges, range, ',')) {
+			const size_t dash = range.find('-');
+			const int first = std::atoi(range.c_str());
+			const int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+			for (int cpu = first; cpu <= last; ++cpu) {
+				cpus.push_back(cpu);
+			}
+		}
+		if (!cpus.empty()) {
+			nodes.push_back(cpus);
+		}
+	}
+#endif
+	if (nodes.empty()) {
+		nodes.emplace_back();
+	}
+	return nodes;
+}
+
+// Runs @p query(i) for all @p numQueries queries on @p numThreads threads,
+// each thread on a contiguous range of queries. Thread t is pinned to
+// cpus[t % cpus.size()], if @p cpus is not empty.
+// Returns the wall time in seconds.
+template <class Query>
+static double runThreads(unsigned int numThreads, uint64_t numQueries, const std::vector<int>& cpus, Query query)
+{
+	std::atomic<unsigned int> ready{0};
+	std::atomic<bool> go{false};
+
+	auto run = [&](unsigned int t) {
+		++ready;
+		while (!go.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+		const uint64_t first = numQueries * t / numThreads;
+		const uint64_t last = numQueries * (t + 1) / numThreads;
+		for (uint64_t i = first; i < last; ++i) {
+			query(i);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < numThreads; ++t)
+	{
+		threads.emplace_back(run, t);
+#ifdef __linux__
+		if (!cpus.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[t % cpus.size()], &set);
+			pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+		}
+#endif
+	}
+	while (ready < numThreads) {
+		std::this_thread::yield();
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Throughput of findKNearest and findInRadius on one shared tree from 1 to
+// all hardware threads, with threads filling one NUMA node after the other
+// (compact) and alternating between the nodes (spread), for trees with and
+// without lazy build and huge pages. The tree is built by the main thread, so
+// its memory is local to the first node it ran on. Lazy trees are rebuilt
+// before every run, such that the threads split the nodes concurrently.
+// The results of every query are compared with the first single threaded
+// run, which catches races on hidden shared state in the queries.
+static void benchmarkThreadScaling(uint64_t numPoints, uint64_t numQueries, unsigned int k)
+{
+	std::vector<float> coords(3 * numPoints);
+	kdtree::DatasetGenerator(kdtree::Distribution::Uniform, numPoints, 42).generate(0, numPoints, coords.data());
+	std::vector<float> queries(3 * numQueries);
+	kdtree::DatasetGenerator(kdtree::Distribution::Uniform, numQueries, 43).generate(0, numQueries, queries.data());
+
+	std::vector<kdtree::SlimPoint> points;
+	points.reserve(numPoints);
+	for (uint64_t i = 0; i < coords.size(); i += 3) {
+		points.push_back(kdtree::SlimPoint(coords[i], coords[i + 1], coords[i + 2]));
+	}
+
+	kdtree::PointCloud<kdtree::SlimPoint> pointCloud;
+	pointCloud.setItems(std::move(points));
+	pointCloud.rebuildTree();
+
+	// about k points per sphere
+	const float radius = std::cbrt(3.0f * k / (4.0f * 3.14159265f * numPoints)) * 1000.0f;
+	const float radius2 = radius * radius;
+
+	// the sum of the square distances of the result of each query
+	auto kNearest = [&](uint64_t i, std::vector<float>& checksums) {
+		thread_local std::vector<kdtree::SlimPoint> result;
+		thread_local std::vector<float> distances;
+		pointCloud.findKNearest(&queries[3 * i], k, result, distances);
+		checksums[i] = std::accumulate(distances.begin(), distances.end(), 0.0f);
+	};
+	auto inRadius = [&](uint64_t i, std::vector<float>& checksums) {
+		thread_local std::vector<kdtree::SlimPoint> result;
+		thread_local std::vector<float> distances;
+		pointCloud.findInRadius(&queries[3 * i], radius2, result, distances);
+		std::sort(distances.begin(), distances.end());
+		checksums[i] = std::accumulate(distances.begin(), distances.end(), 0.0f);
+	};
+
+	const std::vector<std::vector<int>> nodes = numaNodes();
+
+	// 1, 2, 4, ... and all hardware threads, at least 2 to compare the results
+	const unsigned int maxThreads = std::max(2u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> threadCounts;
+	for (unsigned int numThreads = 1; numThreads < maxThreads; numThreads *= 2) {
+		threadCounts.push_back(numThreads);
+	}
+	threadCounts.push_back(maxThreads);
+
+	std::vector<int> compact;
+	std::vector<int> spread;
+	for (const std::vector<int>& cpus : nodes) {
+		compact.insert(compact.end(), cpus.begin(), cpus.end());
+	}
+	for (size_t i = 0; spread.size() < compact.size(); ++i) {
+		for (const std::vector<int>& cpus : nodes) {
+			if (i < cpus.size()) {
+				spread.push_back(cpus[i]);
+			}
+		}
+	}
+
+	std::cout << "thread scaling: " << nodes.size() << " NUMA node(s), "
+			  << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+
+	// the first run with 1 thread of each query is the reference
+	std::vector<float> reference[2];
+
+	for (int config = 0; config < 4; ++config)
+	{
+		const bool lazy = config & 1;
+		const bool hugePages = config & 2;
+		const char* configName[] = {"", ", lazy", ", huge pages", ", lazy, huge pages"};
+		pointCloud.setLazyBuild(lazy);
+		pointCloud.setHugePages(hugePages);
+		pointCloud.rebuildTree();
+
+		for (int query = 0; query < 2; ++query)
+		{
+			const char* name = query == 0 ? "findKNearest" : "findInRadius";
+			auto run = [&](uint64_t i, std::vector<float>& checksums) {
+				query == 0 ? kNearest(i, checksums) : inRadius(i, checksums);
+			};
+
+			// the first run with 1 thread of this configuration
+			double single = 0.0;
+
+			for (const std::vector<int>* placement : {&compact, &spread})
+			{
+				if (placement == &spread && nodes.size() < 2) {
+					break;
+				}
+
+				for (unsigned int numThreads : threadCounts)
+				{
+					if (lazy) {
+						pointCloud.rebuildTree();
+					}
+
+					std::vector<float> checksums(numQueries);
+					const double time = runThreads(numThreads, numQueries, *placement, [&](uint64_t i) { run(i, checksums); });
+					const double throughput = numQueries / time;
+					if (reference[query].empty()) {
+						reference[query] = checksums;
+					}
+					if (single == 0.0) {
+						single = throughput;
+					}
+
+					uint64_t mismatches = 0;
+					for (uint64_t i = 0; i < numQueries; ++i) {
+						mismatches += checksums[i] != reference[query][i];
+					}
+
+					std::cout << "  " << name << configName[config]
+							  << (placement == &compact ? ", compact, " : ", spread,  ")
+							  << numThreads << " threads: "
+							  << throughput << " queries/s, "
+							  << "speedup " << throughput / single << ", "
+							  << "efficiency " << 100.0 * throughput / (single * numThreads) << "%"
+							  << (numThreads > std::thread::hardware_concurrency() ? ", oversubscribed" : "")
+							  << (mismatches ? ", " + std::to_string(mismatches) + " WRONG RESULTS" : "")
+							  << std::endl;
+				}
+			}
+		}
+	}
+}
+
+int main( int argc, char** argv )
+{
+	const uint64_t numPoints = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000000;
+	const uint64_t numQueries = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+	const unsigned int k = argc > 3 ? std::atoi(argv[3]) : 10;
+
+	std::cout << numPoints << " points, " << numQueries << " queries, k = " << k << std::endl;
+#ifdef KDTREE_TRACING
+	kdtree::startTrace("benchmark-trace.json");
+#endif
+	benchmarkHugePages(numPoints, numQueries, k);
+	benchmarkPointTypes(numPoints, numQueries, k);
+	benchmarkCompressed(numPoints, numQueries, k);
+	benchmarkPacketNearest(numPoints, numQueries);
+	benchmarkAnyWithinRadius(numPoints, numQueries);
+	benchmarkRefit(numPoints, numQueries, k);
+	benchmarkLazyBuild(numPoints, k);
+	benchmarkQuerySample(numPoints, numQueries, k);
+	benchmarkQueryRecorder(numPoints, numQueries, k);
+	benchmarkDistributions(numPoints, numQueries, k);
+	benchmarkThreadScaling(numPoints, numQueries, k);
+
+#ifdef KDTREE_TRACING
+	kdtree::stopTrace();
+#endif
+
+	return 0;
+}
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -0,0 +1,437 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_BLOCKREADER_H
+#define KDTREE_BLOCKREADER_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstring> // std::memset
+#include <cstdint> // uint64_t
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define KDTREE_HAVE_IO_URING
+#endif
+
+namespace kdtree
+{
+
+/**
+ * The class @p BlockReader reads blocks of a file asynchronously.
+ *
+ * Requests are identified by a tag. After submit(), the read runs in the
+ * background, wait() returns the tag of any completed request.
+ */
+class BlockReader
+{
+public:
+	virtual ~BlockReader() = default;
+
+	/**
+	 * Start reading @p size bytes at @p offset into @p buffer.
+	 */
+	virtual void submit(uint64_t tag, uint64_t offset, uint64_t size, void* buffer) = 0;
+
+	/**
+	 * Block until a submitted request completes.
+	 * @param tag set to the tag of the completed request
+	 * @return true if all bytes were read, false on a read error
+	 */
+	virtual bool wait(uint64_t& tag) = 0;
+
+	/**
+	 * Returns the amount of requests that should be in flight at most.
+	 */
+	virtual unsigned int queueDepth() const = 0;
+
+	/**
+	 * Returns a reader for the file descriptor @p fd: io_uring if supported by
+	 * the kernel, otherwise a pool of threads using pread().
+	 */
+	static std::unique_ptr<BlockReader> create(int fd);
+
+protected:
+	/**
+	 * Read @p size bytes at @p offset of the file @p fd into @p buffer with
+	 * blocking pread() calls.
+	 * @return true if all bytes were read, false on a read error
+	 */
+	static bool readBlocking(int fd, uint64_t offset, uint64_t size, void* buffer);
+};
+
+/**
+ * The class @p ThreadPoolBlockReader serves requests with a pool of threads
+ * that use blocking pread() calls.
+ */
+class ThreadPoolBlockReader : public BlockReader
+{
+public:
+	explicit ThreadPoolBlockReader(int fd, unsigned int threads = 8);
+	~ThreadPoolBlockReader() override;
+
+	void submit(uint64_t tag, uint64_t offset, uint64_t size, void* buffer) override;
+	bool wait(uint64_t& tag) override;
+	unsigned int queueDepth() const override;
+
+private:
+	struct Request
+	{
+		uint64_t tag;
+		uint64_t offset;
+		uint64_t size;
+		void* buffer;
+	};
+
+	void run();
+
+	int m_fd;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_requested;
+	std::condition_variable m_completed;
+	std::deque<Request> m_requests;
+	std::deque<std::pair<uint64_t, bool>> m_completions;
+	bool m_quit = false;
+};
+
+#ifdef KDTREE_HAVE_IO_URING
+/**
+ * The class @p IoUringBlockReader submits requests to an io_uring instance,
+ * so the kernel keeps the device queue filled without extra threads.
+ */
+class IoUringBlockReader : public BlockReader
+{
+public:
+	explicit IoUringBlockReader(int fd, unsigned int entries = 64);
+	~IoUringBlockReader() override;
+
+	/**
+	 * Returns false, if the kernel does not support io_uring.
+	 */
+	bool isValid() const;
+
+	void submit(uint64_t tag, uint64_t offset, uint64_t size, void* buffer) override;
+	bool wait(uint64_t& tag) override;
+	unsigned int queueDepth() const override;
+
+private:
+	int m_fd;
+	int m_ring = -1;
+	unsigned int m_entries = 0;
+
+	void* m_sqMemory = MAP_FAILED;
+	size_t m_sqSize = 0;
+	void* m_cqMemory = MAP_FAILED;
+	size_t m_cqSize = 0;
+	io_uring_sqe* m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t m_sqesSize = 0;
+
+	unsigned* m_sqTail = nullptr;
+	unsigned* m_sqMask = nullptr;
+	unsigned* m_sqArray = nullptr;
+	unsigned* m_cqHead = nullptr;
+	unsigned* m_cqTail = nullptr;
+	unsigned* m_cqMask = nullptr;
+	io_uring_cqe* m_cqes = nullptr;
+
+	struct Request
+	{
+		uint64_t tag;
+		uint64_t offset;
+		uint64_t size;
+		void* buffer;
+	};
+
+	// requests in flight in the ring, to detect short reads and to read
+	// them directly if the ring fails
+	std::vector<Request> m_pending;
+
+	// true, if waiting for completions failed, see wait()
+	bool m_failed = false;
+
+	// requests that were read without the ring, see submit()
+	std::deque<std::pair<uint64_t, bool>> m_completions;
+};
+#endif
+
+
+//
+//
+// IMPLEMENTATION
+//
+//
+
+inline bool BlockReader::readBlocking(int fd, uint64_t offset, uint64_t size, void* buffer)
+{
+	uint64_t done = 0;
+	while (done < size)
+	{
+		const ssize_t n = pread(fd, static_cast<char*>(buffer) + done, size - done, offset + done);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	return done == size;
+}
+
+inline ThreadPoolBlockReader::ThreadPoolBlockReader(int fd, unsigned int threads)
+	: m_fd(fd)
+{
+	for (unsigned int i = 0; i < threads; ++i) {
+		m_threads.emplace_back(&ThreadPoolBlockReader::run, this);
+	}
+}
+
+inline ThreadPoolBlockReader::~ThreadPoolBlockReader()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_requested.notify_all();
+
+	for (std::thread& thread : m_threads) {
+		thread.join();
+	}
+}
+
+inline void ThreadPoolBlockReader::submit(uint64_t tag, uint64_t offset, uint64_t size, void* buffer)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_requests.push_back(Request{tag, offset, size, buffer});
+	}
+	m_requested.notify_one();
+}
+
+inline bool ThreadPoolBlockReader::wait(uint64_t& tag)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_completed.wait(lock, [this] { return !m_completions.empty(); });
+
+	tag = m_completions.front().first;
+	const bool success = m_completions.front().second;
+	m_completions.pop_front();
+	return success;
+}
+
+inline unsigned int ThreadPoolBlockReader::queueDepth() const
+{
+	return 4 * static_cast<unsigned int>(m_threads.size());
+}
+
+inline void ThreadPoolBlockReader::run()
+{
+	for (;;)
+	{
+		Request request;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_requested.wait(lock, [this] { return m_quit || !m_requests.empty(); });
+			if (m_quit) {
+				return;
+			}
+			request = m_requests.front();
+			m_requests.pop_front();
+		}
+
+		const bool success = readBlocking(m_fd, request.offset, request.size, request.buffer);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_completions.emplace_back(request.tag, success);
+		}
+		m_completed.notify_one();
+	}
+}
+
+#ifdef KDTREE_HAVE_IO_URING
+inline IoUringBlockReader::IoUringBlockReader(int fd, unsigned int entries)
+	: m_fd(fd)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	m_ring = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+	if (m_ring < 0) {
+		return;
+	}
+
+	// IORING_OP_READ needs Linux 5.6, which also introduced this feature flag
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(m_ring);
+		m_ring = -1;
+		return;
+	}
+
+	m_entries = params.sq_entries;
+	m_sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+	m_sqMemory = mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+	m_cqMemory = mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING);
+	m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES));
+	if (m_sqMemory == MAP_FAILED || m_cqMemory == MAP_FAILED || m_sqes == MAP_FAILED) {
+		return;
+	}
+
+	char* sq = static_cast<char*>(m_sqMemory);
+	m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	m_sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+	char* cq = static_cast<char*>(m_cqMemory);
+	m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	m_cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+inline IoUringBlockReader::~IoUringBlockReader()
+{
+	if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqesSize);
+	if (m_cqMemory != MAP_FAILED) munmap(m_cqMemory, m_cqSize);
+	if (m_sqMemory != MAP_FAILED) munmap(m_sqMemory, m_sqSize);
+	if (m_ring >= 0) close(m_ring);
+}
+
+inline bool IoUringBlockReader::isValid() const
+{
+	return m_ring >= 0 && m_sqMemory != MAP_FAILED && m_cqMemory != MAP_FAILED && m_sqes != MAP_FAILED;
+}
+
+inline void IoUringBlockReader::submit(uint64_t tag, uint64_t offset, uint64_t size, void* buffer)
+{
+	// the length of a read entry has 32 bits, larger blocks are read directly
+	if (size > UINT32_MAX || m_failed) {
+		m_completions.emplace_back(tag, readBlocking(m_fd, offset, size, buffer));
+		return;
+	}
+
+	// the caller keeps at most queueDepth() requests in flight, so there is a free entry
+	const unsigned tail = *m_sqTail;
+	const unsigned index = tail & *m_sqMask;
+
+	io_uring_sqe* sqe = &m_sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = m_fd;
+	sqe->addr = reinterpret_cast<uint64_t>(buffer);
+	sqe->len = static_cast<uint32_t>(size);
+	sqe->off = offset;
+	sqe->user_data = tag;
+	m_sqArray[index] = index;
+
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	// retry if interrupted or the kernel is temporarily short of resources
+	for (int attempt = 0; ; ++attempt)
+	{
+		const long submitted = syscall(__NR_io_uring_enter, m_ring, 1, 0, 0, nullptr, 0);
+		if (submitted == 1) {
+			m_pending.push_back(Request{tag, offset, size, buffer});
+			return;
+		}
+		if (submitted < 0 && (errno == EINTR || ((errno == EAGAIN || errno == EBUSY) && attempt < 100))) {
+			std::this_thread::yield();
+			continue;
+		}
+		break;
+	}
+
+	// the kernel did not consume the entry: take it back and read directly,
+	// wait() reports the result like any other completion
+	__atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+	m_completions.emplace_back(tag, readBlocking(m_fd, offset, size, buffer));
+}
+
+inline bool IoUringBlockReader::wait(uint64_t& tag)
+{
+	if (!m_completions.empty())
+	{
+		tag = m_completions.front().first;
+		const bool success = m_completions.front().second;
+		m_completions.pop_front();
+		return success;
+	}
+
+	for (;;)
+	{
+		const unsigned head = *m_cqHead;
+		if (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+		{
+			const io_uring_cqe& cqe = m_cqes[head & *m_cqMask];
+			const uint64_t cqeTag = cqe.user_data;
+			const int32_t result = cqe.res;
+			__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+
+			for (auto it = m_pending.begin(); it != m_pending.end(); ++it) {
+				if (it->tag == cqeTag) {
+					const uint64_t size = it->size;
+					m_pending.erase(it);
+					tag = cqeTag;
+					return result >= 0 && static_cast<uint64_t>(result) == size;
+				}
+			}
+
+			// the request was already read directly, see below
+			continue;
+		}
+
+		if (!m_failed)
+		{
+			const long entered = syscall(__NR_io_uring_enter, m_ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (entered >= 0 || errno == EINTR) {
+				continue;
+			}
+
+			// the ring cannot wait for completions any more: read the requests
+			// still in flight directly, and all further requests in submit()
+			m_failed = true;
+		}
+
+		if (m_pending.empty()) {
+			return false;
+		}
+
+		const Request request = m_pending.front();
+		m_pending.erase(m_pending.begin());
+		tag = request.tag;
+		return readBlocking(m_fd, request.offset, request.size, request.buffer);
+	}
+}
+
+inline unsigned int IoUringBlockReader::queueDepth() const
+{
+	return m_entries;
+}
+#endif
+
+inline std::unique_ptr<BlockReader> BlockReader::create(int fd)
+{
+#ifdef KDTREE_HAVE_IO_URING
+	std::unique_ptr<IoUringBlockReader> ring(new IoUringBlockReader(fd));
+	if (ring->isValid()) {
+		return ring;
+	}
+#endif
+	return std::unique_ptr<BlockReader>(new ThreadPoolBlockReader(fd));
+}
+
+}
+
+#endif // KDTREE_BLOCKREADER_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -10,13 +10,15 @@ SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
 #endif
 
 #include "point.h"
+#include "pointtraits.h"
 #include <vector>
 #include <cstdint> // uint64_t
 
 namespace kdtree
 {
 
-template <class T> class Node;
+template <class T, class Alloc> class Node;
+template <class T> class CompressedPointCloud;
 
 /**
  * The class @p BoundingBox stores the size of a space partition.
@@ -25,7 +27,9 @@ template <class T> class Node;
 template <class T>
 class BoundingBox
 {
-	friend class Node<T>;
+	template <class, class> friend class Node;
+	template <class> friend class BoundingBox;
+	friend class CompressedPointCloud<T>;
 public:
 	/// standard constructor
 	constexpr BoundingBox() noexcept = default;
@@ -37,17 +41,46 @@ public:
 	 * @param begin start bound
 	 * @param end end bound
 	 */
-	BoundingBox(const std::vector<T>& points, uint64_t begin, uint64_t end);
-	~BoundingBox();
+	template <class Alloc>
+	BoundingBox(const std::vector<T, Alloc>& points, uint64_t begin, uint64_t end);
+
+	/**
+	 * constructor for the bounding box containing only the point @p x.
+	 * Use extend() to add further points.
+	 * @param x the point (float array with 3 entries)
+	 */
+	explicit BoundingBox(const float* x);
+
+	/**
+	 * copy constructor from a bounding box for another point type.
+	 */
+	template <class U>
+	explicit BoundingBox(const BoundingBox<U>& other);
+
+	/// trivial destructor, so that bounding boxes can be copied bitwise
+	~BoundingBox() = default;
 
 	/**
 	 * crop the bounding box to a minimal size around the points. This way,
 	 * the average distance is bigger so that we can discard more BBs!
+	 * An empty range gives the box with both corners at the origin.
 	 * @param points points in the bounding box
 	 * @param begin start bound
 	 * @param end end bound
 	 */
-	void crop(const std::vector<T>& points, uint64_t begin, uint64_t end);
+	template <class Alloc>
+	void crop(const std::vector<T, Alloc>& points, uint64_t begin, uint64_t end);
+
+	/**
+	 * grow the bounding box such that it also contains the point @p x.
+	 * @param x the point (float array with 3 entries)
+	 */
+	void extend(const float* x);
+
+	/**
+	 * grow the bounding box such that it also contains the box @p other.
+	 */
+	void extend(const BoundingBox<T>& other);
 
 	/**
 	 * get the longest axis of the quadric bounding box space
@@ -63,6 +96,12 @@ public:
 	 */
 	float distance2(const float* x) const;
 
+	/**
+	 * get the surface area of the bounding box. Large boxes are hit by many
+	 * queries, so the sum over all nodes estimates the cost of a kdtree.
+	 */
+	float surfaceArea() const;
+
 private:
 	float p[3];	///< smallest point-coordinates in all three dimensions
 	float q[3];	///< biggest point-coordinates in all three dimensions
@@ -76,22 +115,40 @@ private:
 //
 
 template <class T>
-BoundingBox<T>::BoundingBox(const std::vector<T>& points, uint64_t begin, uint64_t end)
+template <class Alloc>
+BoundingBox<T>::BoundingBox(const std::vector<T, Alloc>& points, uint64_t begin, uint64_t end)
 {
 	crop(points, begin, end);
 }
 
 template <class T>
-BoundingBox<T>::~BoundingBox()
+BoundingBox<T>::BoundingBox(const float* x)
+	: p{x[0], x[1], x[2]}
+	, q{x[0], x[1], x[2]}
 {
 }
 
 template <class T>
-void BoundingBox<T>::crop(const std::vector<T>& points, uint64_t begin, uint64_t end)
+template <class U>
+BoundingBox<T>::BoundingBox(const BoundingBox<U>& other)
+	: p{other.p[0], other.p[1], other.p[2]}
+	, q{other.q[0], other.q[1], other.q[2]}
 {
-	p[0] = points[begin].p[0];
-	p[1] = points[begin].p[1];
-	p[2] = points[begin].p[2];
+}
+
+template <class T>
+template <class Alloc>
+void BoundingBox<T>::crop(const std::vector<T, Alloc>& points, uint64_t begin, uint64_t end)
+{
+	if (begin == end) {
+		p[0] = p[1] = p[2] = 0.0f;
+		q[0] = q[1] = q[2] = 0.0f;
+		return;
+	}
+
+	p[0] = pointCoordinate(points[begin], 0);
+	p[1] = pointCoordinate(points[begin], 1);
+	p[2] = pointCoordinate(points[begin], 2);
 
 	q[0] = p[0];
 	q[1] = p[1];
@@ -99,18 +156,48 @@ void BoundingBox<T>::crop(const std::vector<T>& points, uint64_t begin, uint64_t
 
 	for (uint64_t i = begin+1; i < end; ++i)
 	{
+		const float x[3] = {
+			pointCoordinate(points[i], 0),
+			pointCoordinate(points[i], 1),
+			pointCoordinate(points[i], 2)
+		};
+
 		// find smallest value along each axis
-		if (points[i].p[0] < p[0]) p[0] = points[i].p[0];
-		if (points[i].p[1] < p[1]) p[1] = points[i].p[1];
-		if (points[i].p[2] < p[2]) p[2] = points[i].p[2];
+		if (x[0] < p[0]) p[0] = x[0];
+		if (x[1] < p[1]) p[1] = x[1];
+		if (x[2] < p[2]) p[2] = x[2];
 
 		// find largest value along each axis
-		if (points[i].p[0] > q[0]) q[0] = points[i].p[0];
-		if (points[i].p[1] > q[1]) q[1] = points[i].p[1];
-		if (points[i].p[2] > q[2]) q[2] = points[i].p[2];
+		if (x[0] > q[0]) q[0] = x[0];
+		if (x[1] > q[1]) q[1] = x[1];
+		if (x[2] > q[2]) q[2] = x[2];
 	}
 }
 
+template <class T>
+void BoundingBox<T>::extend(const float* x)
+{
+	if (x[0] < p[0]) p[0] = x[0];
+	if (x[1] < p[1]) p[1] = x[1];
+	if (x[2] < p[2]) p[2] = x[2];
+
+	if (x[0] > q[0]) q[0] = x[0];
+	if (x[1] > q[1]) q[1] = x[1];
+	if (x[2] > q[2]) q[2] = x[2];
+}
+
+template <class T>
+void BoundingBox<T>::extend(const BoundingBox<T>& other)
+{
+	if (other.p[0] < p[0]) p[0] = other.p[0];
+	if (other.p[1] < p[1]) p[1] = other.p[1];
+	if (other.p[2] < p[2]) p[2] = other.p[2];
+
+	if (other.q[0] > q[0]) q[0] = other.q[0];
+	if (other.q[1] > q[1]) q[1] = other.q[1];
+	if (other.q[2] > q[2]) q[2] = other.q[2];
+}
+
 template <class T>
 int BoundingBox<T>::getSplitAxis() const
 {
@@ -166,6 +253,15 @@ float BoundingBox<T>::distance2(const float* x) const
 	return t0*t0 + t1*t1 + t2*t2;
 }
 
+template <class T>
+float BoundingBox<T>::surfaceArea() const
+{
+	const float dx = q[0] - p[0];
+	const float dy = q[1] - p[1];
+	const float dz = q[2] - p[2];
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
 }
 
 #endif // KDTREE_BOUNDINGBOX_H
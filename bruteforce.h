@@ -0,0 +1,96 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_BRUTEFORCE_H
+#define KDTREE_BRUTEFORCE_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <utility> // std::pair
+#include <cstdint> // uint64_t
+
+#include "pointtraits.h"
+
+namespace kdtree
+{
+
+/**
+ * Find the @p k nearest of the @p count points @p points to the reference
+ * point @p p by scanning all points. This is the reference for the kdtree
+ * queries, e.g. in the verify tool, and deliberately kept simple.
+ * @param indices returned indices into @p points, sorted by distance, ties by index
+ * @param distances returned square distances of the points in @p indices
+ */
+template <class T>
+void bruteForceKNearest(const T* points, uint64_t count, const float* p, unsigned int k,
+						std::vector<uint64_t>& indices, std::vector<float>& distances);
+
+/**
+ * Find all of the @p count points @p points in the sphere with center @p m
+ * and square radius @p radius2, including points on the sphere, by scanning
+ * all points.
+ * @param indices returned indices into @p points, sorted by distance, ties by index
+ * @param distances returned square distances of the points in @p indices
+ */
+template <class T>
+void bruteForceInRadius(const T* points, uint64_t count, const float* m, float radius2,
+						std::vector<uint64_t>& indices, std::vector<float>& distances);
+
+
+//
+//
+// TEMPLATE IMPLEMENTATION
+//
+//
+
+template <class T>
+void bruteForceKNearest(const T* points, uint64_t count, const float* p, unsigned int k,
+						std::vector<uint64_t>& indices, std::vector<float>& distances)
+{
+	std::vector<std::pair<float, uint64_t>> candidates(count);
+	for (uint64_t i = 0; i < count; ++i) {
+		candidates[i] = {pointDistance2(points[i], p), i};
+	}
+
+	const uint64_t n = std::min<uint64_t>(k, count);
+	std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end());
+
+	indices.resize(n);
+	distances.resize(n);
+	for (uint64_t i = 0; i < n; ++i) {
+		distances[i] = candidates[i].first;
+		indices[i] = candidates[i].second;
+	}
+}
+
+template <class T>
+void bruteForceInRadius(const T* points, uint64_t count, const float* m, float radius2,
+						std::vector<uint64_t>& indices, std::vector<float>& distances)
+{
+	std::vector<std::pair<float, uint64_t>> candidates;
+	for (uint64_t i = 0; i < count; ++i) {
+		const float d = pointDistance2(points[i], m);
+		if (d <= radius2) {
+			candidates.emplace_back(d, i);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end());
+
+	indices.resize(candidates.size());
+	distances.resize(candidates.size());
+	for (uint64_t i = 0; i < candidates.size(); ++i) {
+		distances[i] = candidates[i].first;
+		indices[i] = candidates[i].second;
+	}
+}
+
+}
+
+#endif // KDTREE_BRUTEFORCE_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
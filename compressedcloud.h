@@ -0,0 +1,381 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_COMPRESSEDCLOUD_H
+#define KDTREE_COMPRESSEDCLOUD_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstdint> // uint32_t, uint64_t
+
+#include "point.h"
+#include "boundingbox.h"
+#include "node.h"
+#include "neighbors.h"
+
+namespace kdtree
+{
+
+/**
+ * The class @p CompressedPointCloud is a read-only, memory efficient variant
+ * of @p PointCloud for large static clouds.
+ *
+ * The points of a leaf are spatially clustered, so their coordinates are
+ * stored relative to the bounding box of the leaf: each axis is quantized to
+ * @p B bits and all three axes are packed into one 32 bit code. Together with
+ * an implicit tree layout (the point interval of a node follows from the
+ * median split), a point needs about 5 bytes instead of 16 bytes for a
+ * @p kdtree::Point.
+ *
+ * The compression is lossy: a decoded coordinate differs from the original by
+ * at most half a quantization step, i.e. (extent of the leaf box) / 2046 along
+ * each axis. Only the coordinates are kept, query results are constructed via
+ * makePoint(), i.e. T(x, y, z) unless PointTraits<T> provides create().
+ */
+template <class T>
+class CompressedPointCloud
+{
+#ifdef __cpp_concepts
+	static_assert(SpatialPoint<T>, "T needs coordinates, see PointTraits");
+#endif
+
+public:
+	CompressedPointCloud() = default;
+
+	/**
+	 * Find the @p k nearest points to given reference point @p p. The result
+	 * will be stored in the vector @p result, sorted by distance.
+	 * @param p reference point
+	 * @param k amount of points to find
+	 * @param result returned vector containing the decoded points
+	 * @return true on success, false if the cloud is empty.
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result) const;
+
+	/**
+	 * Like findKNearest(), but also returns the square distances of the points
+	 * in the parallel vector @p distances.
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Find all points in the sphere with center @p m and @p radius. The result
+	 * will be stored in the vector @p result.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @param result returned vector containing the decoded points
+	 * @return true on success, false if the cloud is empty.
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result) const;
+
+	/**
+	 * Like findInRadius(), but also returns the square distances of the points
+	 * in the parallel vector @p distances.
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Compress the points @p items. Before the new data is set, the old data
+	 * is removed. The tree is built immediately.
+	 */
+	template <class Alloc>
+	void setItems(const std::vector<T, Alloc>& items);
+
+	/**
+	 * Clear all items, the CompressedPointCloud does not contain any data afterwards.
+	 */
+	void clear();
+
+	/**
+	 * Returns the amount of points.
+	 */
+	uint64_t size() const;
+
+	/**
+	 * Returns the amount of memory in bytes used by the nodes and the points.
+	 */
+	uint64_t memoryUsage() const;
+
+private:
+	struct CompressedNode
+	{
+		BoundingBox<T> box;	///< bounding box, for leaves also the quantization frame
+		uint32_t right;		///< index of the right child, the left child follows directly
+	};
+
+	void build(std::vector<T>& points, uint64_t begin, uint64_t end);
+
+	void findKNearest(uint32_t node, uint64_t begin, uint64_t end, const float* p, unsigned int k,
+					  std::vector<T>& result, std::vector<float>& distances, float& bound) const;
+
+	void findInRadius(uint32_t node, uint64_t begin, uint64_t end, const float* m, float radius2,
+					  std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * decode the points of the leaf @p node and compute their square distance
+	 * to @p x. The results are written to @p xyz (3 floats per point) and @p d2.
+	 */
+	void decodeLeaf(uint32_t node, uint64_t begin, uint64_t end,
+					const float* x, float* xyz, float* d2) const;
+
+	/**
+	 * maximum amount of points in a leaf. Larger than for @p Node, since
+	 * scanning quantized leaves is cheap and every node costs 28 bytes.
+	 */
+	static constexpr uint64_t N = 64;
+
+	/**
+	 * bits per axis of the quantized leaf-relative coordinates.
+	 */
+	static constexpr unsigned int B = 10;
+	static constexpr uint32_t mask = (1u << B) - 1;
+
+	std::vector<CompressedNode> m_nodes;	///< nodes in pre-order
+	std::vector<uint32_t> m_codes;			///< packed coordinates of all points
+};
+
+
+//
+//
+// TEMPLATE IMPLEMENTATION
+//
+//
+
+template <class T>
+template <class Alloc>
+void CompressedPointCloud<T>::setItems(const std::vector<T, Alloc>& items)
+{
+	clear();
+
+	if (items.empty()) {
+		return;
+	}
+
+	// the copy is only needed for partitioning and dropped afterwards
+	std::vector<T> points(items.begin(), items.end());
+	m_codes.resize(points.size());
+	build(points, 0, points.size());
+
+	m_nodes.shrink_to_fit();
+}
+
+template <class T>
+void CompressedPointCloud<T>::build(std::vector<T>& points, uint64_t begin, uint64_t end)
+{
+	const uint32_t index = static_cast<uint32_t>(m_nodes.size());
+	m_nodes.push_back(CompressedNode{BoundingBox<T>(points, begin, end), 0});
+
+	if (end - begin > N)
+	{
+		const uint64_t median = begin + (end - begin) / 2;
+		SortAxisComparator<T> lessThan(m_nodes[index].box.getSplitAxis());
+
+		std::nth_element(points.begin() + begin,
+						 points.begin() + median,
+						 points.begin() + end, lessThan);
+
+		build(points, begin, median);
+		m_nodes[index].right = static_cast<uint32_t>(m_nodes.size());
+		build(points, median, end);
+	}
+	else
+	{
+		// quantize relative to the leaf box
+		const BoundingBox<T>& box = m_nodes[index].box;
+		// mask / extent overflows for tiny, e.g. denormal, extents, so keep the
+		// scale finite. The product then stays within [0; mask + 0.5].
+		float scale[3];
+		for (int a = 0; a < 3; ++a) {
+			const float extent = box.q[a] - box.p[a];
+			scale[a] = extent > 0.0f ? std::min(mask / extent, std::numeric_limits<float>::max()) : 0.0f;
+		}
+
+		for (uint64_t i = begin; i < end; ++i)
+		{
+			uint32_t code = 0;
+			for (int a = 0; a < 3; ++a) {
+				// clamped before the cast, which is undefined for values out of range
+				const float c = (pointCoordinate(points[i], a) - box.p[a]) * scale[a] + 0.5f;
+				code |= static_cast<uint32_t>(c < static_cast<float>(mask) ? c : static_cast<float>(mask)) << (a * B);
+			}
+			m_codes[i] = code;
+		}
+	}
+}
+
+template <class T>
+void CompressedPointCloud<T>::decodeLeaf(uint32_t node, uint64_t begin, uint64_t end,
+										 const float* x, float* xyz, float* d2) const
+{
+	const BoundingBox<T>& box = m_nodes[node].box;
+	const float o0 = box.p[0], o1 = box.p[1], o2 = box.p[2];
+	const float s0 = (box.q[0] - o0) / mask;
+	const float s1 = (box.q[1] - o1) / mask;
+	const float s2 = (box.q[2] - o2) / mask;
+	const uint32_t* codes = m_codes.data() + begin;
+	const uint64_t n = end - begin;
+
+	// branch free, so that the compiler vectorizes the decoding
+	for (uint64_t i = 0; i < n; ++i)
+	{
+		const float px = o0 + static_cast<float>(codes[i] & mask) * s0;
+		const float py = o1 + static_cast<float>((codes[i] >> B) & mask) * s1;
+		const float pz = o2 + static_cast<float>((codes[i] >> (2 * B)) & mask) * s2;
+		xyz[3 * i + 0] = px;
+		xyz[3 * i + 1] = py;
+		xyz[3 * i + 2] = pz;
+		d2[i] = (x[0] - px) * (x[0] - px) + (x[1] - py) * (x[1] - py) + (x[2] - pz) * (x[2] - pz);
+	}
+}
+
+template <class T>
+bool CompressedPointCloud<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result) const
+{
+	std::vector<float> distances;
+	return findKNearest(p, k, result, distances);
+}
+
+template <class T>
+bool CompressedPointCloud<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const
+{
+	result.clear();
+	distances.clear();
+
+	if (m_nodes.empty()) {
+		return false;
+	}
+
+	if (k > 0)
+	{
+		float bound = std::numeric_limits<float>::max();
+		findKNearest(0, 0, m_codes.size(), p, k, result, distances, bound);
+
+		// less than k points in the cloud
+		if (result.size() < k) {
+			sortNearest(result, distances);
+		}
+	}
+
+	return true;
+}
+
+template <class T>
+void CompressedPointCloud<T>::findKNearest(uint32_t node, uint64_t begin, uint64_t end, const float* p, unsigned int k,
+										   std::vector<T>& result, std::vector<float>& distances, float& bound) const
+{
+	if (m_nodes[node].right)
+	{
+		const uint64_t median = begin + (end - begin) / 2;
+		const uint32_t left = node + 1;
+		const uint32_t right = m_nodes[node].right;
+		const float tl = m_nodes[left].box.distance2(p);
+		const float tr = m_nodes[right].box.distance2(p);
+		if (tl < bound && tl < tr)
+		{
+			findKNearest(left, begin, median, p, k, result, distances, bound);
+			if (tr < bound) findKNearest(right, median, end, p, k, result, distances, bound);
+		}
+		else if (tr < bound)
+		{
+			findKNearest(right, median, end, p, k, result, distances, bound);
+			if (tl < bound) findKNearest(left, begin, median, p, k, result, distances, bound);
+		}
+		return;
+	}
+
+	float xyz[3 * N];
+	float d2[N];
+	decodeLeaf(node, begin, end, p, xyz, d2);
+
+	for (uint64_t i = 0; i < end - begin; ++i)
+	{
+		if (d2[i] < bound)
+		{
+			bound = insertNearest(result, distances, k, makePoint<T>(xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]), d2[i]);
+		}
+	}
+}
+
+template <class T>
+bool CompressedPointCloud<T>::findInRadius(const float* m, float radius2, std::vector<T>& result) const
+{
+	std::vector<float> distances;
+	return findInRadius(m, radius2, result, distances);
+}
+
+template <class T>
+bool CompressedPointCloud<T>::findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const
+{
+	if (m_nodes.empty()) {
+		return false;
+	}
+
+	result.clear();
+	distances.clear();
+	findInRadius(0, 0, m_codes.size(), m, radius2, result, distances);
+	return true;
+}
+
+template <class T>
+void CompressedPointCloud<T>::findInRadius(uint32_t node, uint64_t begin, uint64_t end, const float* m, float radius2,
+										   std::vector<T>& result, std::vector<float>& distances) const
+{
+	if (m_nodes[node].right)
+	{
+		const uint64_t median = begin + (end - begin) / 2;
+		if (m_nodes[node + 1].box.distance2(m) <= radius2)
+		{
+			findInRadius(node + 1, begin, median, m, radius2, result, distances);
+		}
+		if (m_nodes[m_nodes[node].right].box.distance2(m) <= radius2)
+		{
+			findInRadius(m_nodes[node].right, median, end, m, radius2, result, distances);
+		}
+		return;
+	}
+
+	float xyz[3 * N];
+	float d2[N];
+	decodeLeaf(node, begin, end, m, xyz, d2);
+
+	for (uint64_t i = 0; i < end - begin; ++i)
+	{
+		if (d2[i] <= radius2)
+		{
+			result.push_back(makePoint<T>(xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]));
+			setDistance(result.back(), d2[i]);
+			distances.push_back(d2[i]);
+		}
+	}
+}
+
+template <class T>
+void CompressedPointCloud<T>::clear()
+{
+	m_nodes.clear();
+	m_codes.clear();
+}
+
+template <class T>
+uint64_t CompressedPointCloud<T>::size() const
+{
+	return m_codes.size();
+}
+
+template <class T>
+uint64_t CompressedPointCloud<T>::memoryUsage() const
+{
+	return m_nodes.capacity() * sizeof(CompressedNode) + m_codes.capacity() * sizeof(uint32_t);
+}
+
+}
+
+#endif // KDTREE_COMPRESSEDCLOUD_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
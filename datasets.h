@@ -0,0 +1,426 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_DATASETS_H
+#define KDTREE_DATASETS_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring> // std::memcmp
+#include <cstdint> // uint64_t
+
+namespace kdtree
+{
+
+/**
+ * The synthetic point distributions of @p DatasetGenerator. All of them
+ * lie roughly in the cube [0, 1000]^3.
+ */
+enum class Distribution : uint32_t {
+	Uniform = 0,			///< uniform in the cube
+	GaussianClusters = 1,	///< 64 gaussian clusters of different size
+	Planes = 2,				///< 16 noisy planar patches of 200 x 200
+	LidarRings = 3,			///< scanline rings of a 64 beam LiDAR driving along a path
+	Duplicates = 4,			///< integer positions, each repeated about 64 times
+	Anisotropic = 5,		///< a needle of length 1000 and width 0.01 along a random direction
+	DistributionCount = 6
+};
+
+/**
+ * Returns the name of @p distribution, e.g. "uniform".
+ */
+inline const char* distributionName(Distribution distribution);
+
+/**
+ * Finds the distribution with the name @p name.
+ * @return true on success, false if there is no such distribution.
+ */
+inline bool distributionFromName(const std::string& name, Distribution& distribution);
+
+/**
+ * The class @p DatasetGenerator creates reproducible synthetic point clouds.
+ *
+ * Each point is computed from the seed and its index only, so a dataset of
+ * any size is generated in blocks, in any order and on several threads, and
+ * is always the same for the same seed and size.
+ */
+class DatasetGenerator
+{
+public:
+	/**
+	 * Create a generator for @p count points with distribution @p distribution.
+	 * The size determines the amount of distinct positions of Duplicates.
+	 */
+	DatasetGenerator(Distribution distribution, uint64_t count, uint64_t seed = 42);
+
+	/**
+	 * Write the coordinates of the points @p first to @p first + @p count - 1
+	 * to @p xyz (3 floats per point).
+	 */
+	void generate(uint64_t first, uint64_t count, float* xyz) const;
+
+	Distribution distribution() const;
+	uint64_t count() const;
+	uint64_t seed() const;
+
+private:
+	/**
+	 * A counter based random number generator (splitmix64): the random
+	 * numbers for a point are the sequence started by its index.
+	 */
+	class Random
+	{
+	public:
+		Random(uint64_t seed, uint64_t stream, uint64_t index);
+		uint64_t next();
+		float uniform();				///< [0, 1)
+		float uniform(float a, float b);	///< between a and b
+		float normal();					///< mean 0, standard deviation 1
+	private:
+		static uint64_t mix(uint64_t z);
+		uint64_t m_state;
+	};
+
+	void point(uint64_t index, float* p) const;
+
+	/// the parameters of the distribution, derived from the seed
+	struct Shape
+	{
+		float center[3];
+		float axis[2][3];		///< orthonormal directions in a plane
+		float normal[3];
+		float size;
+	};
+	static constexpr int shapeCount = 64;
+
+	Distribution m_distribution;
+	uint64_t m_count;
+	uint64_t m_seed;
+	Shape m_shapes[shapeCount];
+};
+
+/**
+ * The struct @p DatasetHeader starts a dataset file written by writeDataset(),
+ * followed by @p count points of 3 floats each.
+ */
+struct DatasetHeader
+{
+	char magic[8];			///< "KDPOINT" followed by a 0 byte
+	uint32_t version;		///< version of the file layout
+	uint32_t byteOrder;		///< @p datasetByteOrder in the byte order of the writer
+	uint32_t distribution;	///< the @p Distribution
+	uint32_t reserved;		///< 0
+	uint64_t seed;			///< seed of the generator
+	uint64_t count;			///< amount of points
+};
+
+static_assert(sizeof(DatasetHeader) == 40, "DatasetHeader must have a fixed size");
+
+static constexpr char datasetMagic[8] = {'K', 'D', 'P', 'O', 'I', 'N', 'T', 0};
+static constexpr uint32_t datasetVersion = 1;
+static constexpr uint32_t datasetByteOrder = 0x01020304;
+
+/**
+ * Stream the points of @p generator to the file @p fileName in blocks of
+ * @p blockSize points, so datasets larger than the main memory can be written.
+ * @return true on success, false if writing failed.
+ */
+inline bool writeDataset(const std::string& fileName, const DatasetGenerator& generator, uint64_t blockSize = 1 << 20);
+
+/**
+ * Read the header of the dataset file @p fileName.
+ * @return true on success, false if the file cannot be read or is invalid.
+ */
+inline bool readDatasetHeader(const std::string& fileName, DatasetHeader& header);
+
+/**
+ * Read @p count points starting at point @p first from the dataset file
+ * @p fileName, e.g. block by block.
+ * @param xyz returned coordinates, 3 floats per point
+ * @return true on success, false if the file is invalid or too short.
+ */
+inline bool readDataset(const std::string& fileName, uint64_t first, uint64_t count, std::vector<float>& xyz);
+
+
+//
+//
+// IMPLEMENTATION
+//
+//
+
+inline const char* distributionName(Distribution distribution)
+{
+	switch (distribution) {
+		case Distribution::Uniform: return "uniform";
+		case Distribution::GaussianClusters: return "clusters";
+		case Distribution::Planes: return "planes";
+		case Distribution::LidarRings: return "lidar";
+		case Distribution::Duplicates: return "duplicates";
+		case Distribution::Anisotropic: return "anisotropic";
+		default: return "unknown";
+	}
+}
+
+inline bool distributionFromName(const std::string& name, Distribution& distribution)
+{
+	for (uint32_t i = 0; i < static_cast<uint32_t>(Distribution::DistributionCount); ++i) {
+		if (name == distributionName(static_cast<Distribution>(i))) {
+			distribution = static_cast<Distribution>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+inline uint64_t DatasetGenerator::Random::mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+inline DatasetGenerator::Random::Random(uint64_t seed, uint64_t stream, uint64_t index)
+	// hashed, otherwise the sequences of neighboring indices would overlap
+	: m_state(mix(mix(seed * 0xd1342543de82ef95ull + stream) + index))
+{
+}
+
+inline uint64_t DatasetGenerator::Random::next()
+{
+	return mix(m_state += 0x9e3779b97f4a7c15ull);
+}
+
+inline float DatasetGenerator::Random::uniform()
+{
+	// 24 random bits, so the result is always < 1
+	return (next() >> 40) * (1.0f / 16777216.0f);
+}
+
+inline float DatasetGenerator::Random::uniform(float a, float b)
+{
+	return a + (b - a) * uniform();
+}
+
+inline float DatasetGenerator::Random::normal()
+{
+	// Box-Muller, 1 - uniform() avoids log(0)
+	const float u = 1.0f - uniform();
+	const float v = uniform();
+	return std::sqrt(-2.0f * std::log(u)) * std::cos(6.2831853f * v);
+}
+
+inline DatasetGenerator::DatasetGenerator(Distribution distribution, uint64_t count, uint64_t seed)
+	: m_distribution(distribution)
+	, m_count(count)
+	, m_seed(seed)
+{
+	Random random(seed, 1, 0);
+	for (Shape& shape : m_shapes)
+	{
+		for (float& c : shape.center) {
+			c = random.uniform(100.0f, 900.0f);
+		}
+
+		// a random direction and two directions perpendicular to it
+		float n[3] = {random.normal(), random.normal(), random.normal()};
+		float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		for (int i = 0; i < 3; ++i) {
+			shape.normal[i] = length > 0.0f ? n[i] / length : (i == 2);
+		}
+
+		static constexpr float ex[3] = {1.0f, 0.0f, 0.0f};
+		static constexpr float ey[3] = {0.0f, 1.0f, 0.0f};
+		const float* a = std::fabs(shape.normal[0]) < 0.9f ? ex : ey;
+		float* u = shape.axis[0];
+		float* v = shape.axis[1];
+		const float* w = shape.normal;
+		u[0] = a[1] * w[2] - a[2] * w[1];
+		u[1] = a[2] * w[0] - a[0] * w[2];
+		u[2] = a[0] * w[1] - a[1] * w[0];
+		length = std::sqrt(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+		for (int i = 0; i < 3; ++i) {
+			u[i] /= length;
+		}
+		v[0] = w[1] * u[2] - w[2] * u[1];
+		v[1] = w[2] * u[0] - w[0] * u[2];
+		v[2] = w[0] * u[1] - w[1] * u[0];
+
+		shape.size = random.uniform(5.0f, 40.0f);
+	}
+}
+
+inline Distribution DatasetGenerator::distribution() const
+{
+	return m_distribution;
+}
+
+inline uint64_t DatasetGenerator::count() const
+{
+	return m_count;
+}
+
+inline uint64_t DatasetGenerator::seed() const
+{
+	return m_seed;
+}
+
+inline void DatasetGenerator::generate(uint64_t first, uint64_t count, float* xyz) const
+{
+	for (uint64_t i = 0; i < count; ++i) {
+		point(first + i, xyz + 3 * i);
+	}
+}
+
+inline void DatasetGenerator::point(uint64_t index, float* p) const
+{
+	Random random(m_seed, 2, index);
+
+	switch (m_distribution)
+	{
+		case Distribution::Uniform:
+		default:
+			for (int i = 0; i < 3; ++i) {
+				p[i] = random.uniform(0.0f, 1000.0f);
+			}
+			break;
+
+		case Distribution::GaussianClusters: {
+			const Shape& shape = m_shapes[random.next() % shapeCount];
+			for (int i = 0; i < 3; ++i) {
+				p[i] = shape.center[i] + shape.size * random.normal();
+			}
+			break;
+		}
+
+		case Distribution::Planes: {
+			// 16 patches of 200 x 200 with 1 cm noise, like scanned walls
+			const Shape& shape = m_shapes[random.next() % 16];
+			const float s = random.uniform(-100.0f, 100.0f);
+			const float t = random.uniform(-100.0f, 100.0f);
+			const float d = 0.01f * random.normal();
+			for (int i = 0; i < 3; ++i) {
+				p[i] = shape.center[i] + s * shape.axis[0][i] + t * shape.axis[1][i] + d * shape.normal[i];
+			}
+			break;
+		}
+
+		case Distribution::LidarRings: {
+			// 64 beams from -25 to +3 degrees elevation, 2048 points per beam
+			// and revolution, the sensor 2 m above the ground moves 1 m per revolution
+			constexpr uint64_t beams = 64;
+			constexpr uint64_t azimuths = 2048;
+			const uint64_t revolution = index / (beams * azimuths);
+			const uint64_t beam = index % beams;
+			const uint64_t column = (index / beams) % azimuths;
+
+			const float elevation = (-25.0f + 28.0f * beam / (beams - 1)) * 0.017453293f;
+			const float azimuth = 6.2831853f * column / azimuths;
+			const float sensor[3] = {100.0f + std::fmod(static_cast<float>(revolution), 800.0f), 500.0f, 2.0f};
+
+			// downward beams hit the ground, the others walls at 20 to 80 m
+			const float wall = 50.0f + 30.0f * std::sin(3.0f * azimuth + 0.01f * revolution);
+			float range = wall;
+			if (elevation < 0.0f) {
+				range = std::min(wall, sensor[2] / std::sin(-elevation));
+			}
+			range += 0.02f * random.normal();
+
+			const float horizontal = range * std::cos(elevation);
+			p[0] = sensor[0] + horizontal * std::cos(azimuth);
+			p[1] = sensor[1] + horizontal * std::sin(azimuth);
+			p[2] = sensor[2] + range * std::sin(elevation);
+			break;
+		}
+
+		case Distribution::Duplicates: {
+			// about 64 exact copies of each integer position, like the grid in main.cpp
+			const uint64_t sites = m_count / 64 + 1;
+			Random site(m_seed, 3, random.next() % sites);
+			for (int i = 0; i < 3; ++i) {
+				p[i] = std::floor(site.uniform(0.0f, 1000.0f));
+			}
+			break;
+		}
+
+		case Distribution::Anisotropic: {
+			const Shape& shape = m_shapes[0];
+			const float t = random.uniform(-500.0f, 500.0f);
+			const float s = 0.005f * random.normal();
+			const float u = 0.005f * random.normal();
+			for (int i = 0; i < 3; ++i) {
+				p[i] = 500.0f + t * shape.normal[i] + s * shape.axis[0][i] + u * shape.axis[1][i];
+			}
+			break;
+		}
+	}
+}
+
+inline bool writeDataset(const std::string& fileName, const DatasetGenerator& generator, uint64_t blockSize)
+{
+	std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+
+	DatasetHeader header;
+	std::memcpy(header.magic, datasetMagic, sizeof(header.magic));
+	header.version = datasetVersion;
+	header.byteOrder = datasetByteOrder;
+	header.distribution = static_cast<uint32_t>(generator.distribution());
+	header.reserved = 0;
+	header.seed = generator.seed();
+	header.count = generator.count();
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	std::vector<float> block(3 * std::max<uint64_t>(1, std::min(blockSize, generator.count())));
+	for (uint64_t first = 0; first < generator.count() && file; first += block.size() / 3)
+	{
+		const uint64_t count = std::min<uint64_t>(block.size() / 3, generator.count() - first);
+		generator.generate(first, count, block.data());
+		file.write(reinterpret_cast<const char*>(block.data()), 3 * count * sizeof(float));
+	}
+
+	return static_cast<bool>(file.flush());
+}
+
+inline bool readDatasetHeader(const std::string& fileName, DatasetHeader& header)
+{
+	std::ifstream file(fileName, std::ios::binary);
+	return file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		&& std::memcmp(header.magic, datasetMagic, sizeof(header.magic)) == 0
+		&& header.version == datasetVersion
+		&& header.byteOrder == datasetByteOrder;
+}
+
+inline bool readDataset(const std::string& fileName, uint64_t first, uint64_t count, std::vector<float>& xyz)
+{
+	xyz.clear();
+
+	DatasetHeader header;
+	if (!readDatasetHeader(fileName, header) || first > header.count || count > header.count - first) {
+		return false;
+	}
+
+	std::ifstream file(fileName, std::ios::binary);
+	file.seekg(sizeof(header) + 3 * first * sizeof(float));
+	xyz.resize(3 * count);
+	if (!file.read(reinterpret_cast<char*>(xyz.data()), xyz.size() * sizeof(float))) {
+		xyz.clear();
+		return false;
+	}
+	return true;
+}
+
+}
+
+#endif // KDTREE_DATASETS_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
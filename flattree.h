@@ -0,0 +1,551 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_FLATTREE_H
+#define KDTREE_FLATTREE_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <atomic>  // std::atomic_thread_fence
+#include <cstring> // std::memcpy, std::memcmp
+#include <cstdint> // uint32_t, uint64_t
+
+#include "point.h"
+#include "boundingbox.h"
+#include "neighbors.h"
+
+namespace kdtree
+{
+
+/**
+ * The struct @p FlatNode is a kdtree node without pointers. All nodes of a
+ * tree are stored in one array in pre-order: the left child of a node directly
+ * follows the node, the right child is referenced by its array index. This
+ * way, a tree can be placed at any address, e.g. in shared memory or a file.
+ */
+struct FlatNode
+{
+	BoundingBox<Point> box;	///< bounding box of the points [begin; end)
+	uint64_t begin;			///< first point of the node
+	uint64_t end;			///< one past the last point of the node
+	uint32_t right;			///< array index of the right child, 0 for leaves
+	uint32_t reserved;		///< always 0
+};
+
+static_assert(sizeof(FlatNode) == 48, "FlatNode must have a fixed size");
+static_assert(std::is_trivially_copyable<FlatNode>::value, "FlatNode must be copyable bitwise");
+
+/**
+ * The class @p FlatTreeView provides read-only queries on a flat tree, i.e.
+ * an array of @p FlatNode and the array of points the nodes refer to. The
+ * view does not own the memory.
+ */
+template <class T>
+class FlatTreeView
+{
+#ifdef __cpp_concepts
+	static_assert(SpatialPoint<T>, "T needs coordinates, see PointTraits");
+#endif
+
+public:
+	FlatTreeView() = default;
+
+	/**
+	 * Constructor. The arrays must outlive the view.
+	 * @param nodes nodes in pre-order, the root node first
+	 * @param numNodes amount of nodes
+	 * @param points the points, sorted by the tree
+	 * @param numPoints amount of points
+	 */
+	FlatTreeView(const FlatNode* nodes, uint64_t numNodes, const T* points, uint64_t numPoints);
+
+	/**
+	 * Find the @p k nearest points to given reference point @p p. The result
+	 * will be stored in the vector @p result, sorted by distance.
+	 * @param p reference point
+	 * @param k amount of points to find
+	 * @param result returned vector containing the points
+	 * @return true on success, false if the view is empty.
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result) const;
+
+	/**
+	 * Like findKNearest(), but also returns the square distances of the points
+	 * in the parallel vector @p distances.
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Find all points in the sphere with center @p m and @p radius. The result
+	 * will be stored in the vector @p result.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @param result returned vector containing the points
+	 * @return true on success, false if the view is empty.
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result) const;
+
+	/**
+	 * Like findInRadius(), but also returns the square distances of the points
+	 * in the parallel vector @p distances.
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Returns the points, sorted by the tree.
+	 */
+	const T* points() const;
+
+	/**
+	 * Returns the amount of points.
+	 */
+	uint64_t size() const;
+
+	/**
+	 * Returns the nodes in pre-order.
+	 */
+	const FlatNode* nodes() const;
+
+	/**
+	 * Returns the amount of nodes.
+	 */
+	uint64_t nodeCount() const;
+
+private:
+	void findKNearest(uint32_t node, const float* p, unsigned int k, std::vector<T>& result,
+					  std::vector<float>& distances, float& bound) const;
+	void findInRadius(uint32_t node, const float* m, float radius2, std::vector<T>& result,
+					  std::vector<float>& distances) const;
+
+	const FlatNode* m_nodes = nullptr;
+	uint64_t m_numNodes = 0;
+	const T* m_points = nullptr;
+	uint64_t m_numPoints = 0;
+};
+
+/**
+ * The struct @p FlatTreeHeader starts a flat tree image. An image is one
+ * contiguous block of memory with the header, the node array and the point
+ * array, see writeFlatTree() and readFlatTree(). All offsets are relative to
+ * the start of the image, so the image can be mapped or loaded at any address
+ * and used without fixing up pointers.
+ *
+ * Image layout, version 1. All integers and floats are stored in the byte
+ * order of the writer, which is tagged by @p byteOrder:
+ *
+ *   offset  size  field
+ *        0     8  magic        "KDTREE\0\0"
+ *        8     4  version      1
+ *       12     4  byteOrder    0x01020304 as written by the writer
+ *       16     4  pointSize    sizeof(T), the points are stored bitwise
+ *       20     4  nodeSize     48, sizeof(FlatNode)
+ *       24     8  numNodes     amount of nodes, at most 2^32 - 1
+ *       32     8  numPoints    amount of points
+ *       40     8  nodesOffset  offset of the node array, 64 byte aligned
+ *       48     8  pointsOffset offset of the point array, 64 byte aligned
+ *       56     8  size         size of the image in bytes
+ *
+ * Each node (48 bytes) consists of the bounding box minimum (3 floats) and
+ * maximum (3 floats), the point interval [begin; end) as two uint64, the
+ * index of the right child as uint32 (0 for a leaf), and 4 bytes that are 0.
+ * Nodes are in pre-order with the root at index 0, the left child of an inner
+ * node directly follows it. Points follow in tree order: the points of a leaf
+ * are the points [begin; end).
+ *
+ * An image is valid if all offsets lie within the image, the nodes are in
+ * exact pre-order (each right child index is the end of the left subtree,
+ * and every node belongs to the tree once), the intervals of the children
+ * split the interval of their parent, the root interval is [0; numPoints),
+ * and the tree is at most @p flatTreeMaxDepth levels deep.
+ * readFlatTree() checks all of this, it never reads outside the image.
+ */
+struct FlatTreeHeader
+{
+	char magic[8];			///< "KDTREE" followed by two 0 bytes
+	uint32_t version;		///< version of the image layout
+	uint32_t byteOrder;		///< @p flatTreeByteOrder in the byte order of the writer
+	uint32_t pointSize;		///< sizeof(T) of the stored points
+	uint32_t nodeSize;		///< sizeof(FlatNode)
+	uint64_t numNodes;		///< amount of nodes
+	uint64_t numPoints;		///< amount of points
+	uint64_t nodesOffset;	///< offset of the node array
+	uint64_t pointsOffset;	///< offset of the point array
+	uint64_t size;			///< size of the whole image
+};
+
+static_assert(sizeof(FlatTreeHeader) == 64, "FlatTreeHeader must have a fixed size");
+
+static constexpr char flatTreeMagic[8] = {'K', 'D', 'T', 'R', 'E', 'E', 0, 0};
+static constexpr uint32_t flatTreeVersion = 1;
+static constexpr uint32_t flatTreeByteOrder = 0x01020304;
+
+/**
+ * maximum depth of a flat tree accepted by readFlatTree(). Balanced trees of
+ * 2^64 points stay far below, it only protects against corrupt images.
+ */
+static constexpr uint8_t flatTreeMaxDepth = 200;
+
+/**
+ * Returns the header of a flat tree image with @p numNodes nodes and
+ * @p numPoints points of @p pointSize bytes each.
+ */
+inline FlatTreeHeader flatTreeHeader(uint64_t numNodes, uint64_t numPoints, uint32_t pointSize);
+
+/**
+ * Returns true, if @p header describes a valid image of at most @p size bytes
+ * with points of @p pointSize bytes and alignment @p pointAlignment.
+ */
+inline bool validFlatTreeHeader(const FlatTreeHeader& header, uint64_t size, uint32_t pointSize, uint64_t pointAlignment);
+
+/**
+ * Returns true, if the @p numNodes nodes @p nodes form a valid tree over
+ * @p numPoints points, see @p FlatTreeHeader.
+ */
+inline bool validFlatTreeNodes(const FlatNode* nodes, uint64_t numNodes, uint64_t numPoints);
+
+/**
+ * Write the flat tree image of @p nodes and @p points to @p image.
+ * The magic bytes are written last, so an incomplete image is never valid.
+ * @param image destination with at least the returned amount of bytes,
+ *        aligned to 8 bytes. If null, only the size is computed.
+ * @return size of the image in bytes
+ */
+template <class T>
+uint64_t writeFlatTree(const std::vector<FlatNode>& nodes, const T* points, uint64_t numPoints, void* image);
+
+/**
+ * Create a view on the flat tree image @p image of @p size bytes. The image is
+ * validated, such that all node references and point intervals are in range.
+ * Images written on a host with another byte order are rejected.
+ * @param image the image, aligned to alignof(T) and 8 bytes
+ * @return true on success, false if the image is invalid.
+ */
+template <class T>
+bool readFlatTree(const void* image, uint64_t size, FlatTreeView<T>& view);
+
+
+//
+//
+// TEMPLATE IMPLEMENTATION
+//
+//
+
+template <class T>
+FlatTreeView<T>::FlatTreeView(const FlatNode* nodes, uint64_t numNodes, const T* points, uint64_t numPoints)
+	: m_nodes(nodes)
+	, m_numNodes(numNodes)
+	, m_points(points)
+	, m_numPoints(numPoints)
+{
+}
+
+template <class T>
+bool FlatTreeView<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result) const
+{
+	std::vector<float> distances;
+	return findKNearest(p, k, result, distances);
+}
+
+template <class T>
+bool FlatTreeView<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const
+{
+	result.clear();
+	distances.clear();
+
+	if (!m_numNodes) {
+		return false;
+	}
+
+	if (k > 0)
+	{
+		float bound = std::numeric_limits<float>::max();
+		findKNearest(0, p, k, result, distances, bound);
+
+		// less than k points in the tree
+		if (result.size() < k) {
+			sortNearest(result, distances);
+		}
+	}
+
+	return true;
+}
+
+template <class T>
+void FlatTreeView<T>::findKNearest(uint32_t node, const float* p, unsigned int k, std::vector<T>& result,
+								   std::vector<float>& distances, float& bound) const
+{
+	const FlatNode& n = m_nodes[node];
+	if (n.right)
+	{
+		const uint32_t left = node + 1;
+		const float tl = m_nodes[left].box.distance2(p);
+		const float tr = m_nodes[n.right].box.distance2(p);
+		if (tl < bound && tl < tr)
+		{
+			findKNearest(left, p, k, result, distances, bound);
+			if (tr < bound) findKNearest(n.right, p, k, result, distances, bound);
+		}
+		else if (tr < bound)
+		{
+			findKNearest(n.right, p, k, result, distances, bound);
+			if (tl < bound) findKNearest(left, p, k, result, distances, bound);
+		}
+		return;
+	}
+
+	for (uint64_t i = n.begin; i < n.end; ++i)
+	{
+		const float d = pointDistance2(m_points[i], p);
+		if (d < bound)
+		{
+			bound = insertNearest(result, distances, k, m_points[i], d);
+		}
+	}
+}
+
+template <class T>
+bool FlatTreeView<T>::findInRadius(const float* m, float radius2, std::vector<T>& result) const
+{
+	std::vector<float> distances;
+	return findInRadius(m, radius2, result, distances);
+}
+
+template <class T>
+bool FlatTreeView<T>::findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const
+{
+	result.clear();
+	distances.clear();
+
+	if (!m_numNodes) {
+		return false;
+	}
+
+	findInRadius(0, m, radius2, result, distances);
+	return true;
+}
+
+template <class T>
+void FlatTreeView<T>::findInRadius(uint32_t node, const float* m, float radius2, std::vector<T>& result,
+								   std::vector<float>& distances) const
+{
+	const FlatNode& n = m_nodes[node];
+	if (n.right)
+	{
+		if (m_nodes[node + 1].box.distance2(m) <= radius2)
+		{
+			findInRadius(node + 1, m, radius2, result, distances);
+		}
+		if (m_nodes[n.right].box.distance2(m) <= radius2)
+		{
+			findInRadius(n.right, m, radius2, result, distances);
+		}
+		return;
+	}
+
+	for (uint64_t i = n.begin; i < n.end; ++i)
+	{
+		const float d = pointDistance2(m_points[i], m);
+		if (d <= radius2)
+		{
+			result.push_back(m_points[i]);
+			setDistance(result.back(), d);
+			distances.push_back(d);
+		}
+	}
+}
+
+template <class T>
+const T* FlatTreeView<T>::points() const
+{
+	return m_points;
+}
+
+template <class T>
+uint64_t FlatTreeView<T>::size() const
+{
+	return m_numPoints;
+}
+
+template <class T>
+const FlatNode* FlatTreeView<T>::nodes() const
+{
+	return m_nodes;
+}
+
+template <class T>
+uint64_t FlatTreeView<T>::nodeCount() const
+{
+	return m_numNodes;
+}
+
+inline FlatTreeHeader flatTreeHeader(uint64_t numNodes, uint64_t numPoints, uint32_t pointSize)
+{
+	// keep the arrays cache line aligned
+	const auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };
+
+	FlatTreeHeader header = {};
+	std::memcpy(header.magic, flatTreeMagic, sizeof(flatTreeMagic));
+	header.version = flatTreeVersion;
+	header.byteOrder = flatTreeByteOrder;
+	header.pointSize = pointSize;
+	header.nodeSize = sizeof(FlatNode);
+	header.numNodes = numNodes;
+	header.numPoints = numPoints;
+	header.nodesOffset = align(sizeof(FlatTreeHeader));
+	header.pointsOffset = align(header.nodesOffset + numNodes * sizeof(FlatNode));
+	header.size = header.pointsOffset + numPoints * pointSize;
+	return header;
+}
+
+inline bool validFlatTreeHeader(const FlatTreeHeader& header, uint64_t size, uint32_t pointSize, uint64_t pointAlignment)
+{
+	return std::memcmp(header.magic, flatTreeMagic, sizeof(flatTreeMagic)) == 0
+		&& header.version == flatTreeVersion
+		&& header.byteOrder == flatTreeByteOrder
+		&& header.pointSize == pointSize
+		&& header.nodeSize == sizeof(FlatNode)
+		&& header.size <= size
+		&& header.nodesOffset % alignof(FlatNode) == 0
+		&& header.pointsOffset % pointAlignment == 0
+		&& header.nodesOffset <= header.size
+		&& header.numNodes <= (header.size - header.nodesOffset) / sizeof(FlatNode)
+		&& header.numNodes <= UINT32_MAX
+		&& header.pointsOffset <= header.size
+		&& header.numPoints <= (header.size - header.pointsOffset) / pointSize;
+}
+
+inline bool validFlatTreeNodes(const FlatNode* nodes, uint64_t numNodes, uint64_t numPoints)
+{
+	if (!numNodes) {
+		return numPoints == 0;
+	}
+
+	// Walk the nodes in array order and require the exact pre-order layout:
+	// node i + 1 is the left child of an inner node i, or the pending right
+	// child on top of the stack after a leaf i. So every node is reached
+	// exactly once, and each right index is the end of its left subtree.
+	// The children split the interval of their parent at one point, so the
+	// leaves tile [0; numPoints) in order.
+	struct Pending
+	{
+		uint64_t right;	// index of the right child
+		uint64_t end;	// end of the interval of the right child
+		uint8_t depth;	// depth of the right child
+	};
+	std::vector<Pending> stack;
+
+	uint64_t begin = 0;			// required begin of node i
+	uint64_t end = numPoints;	// required end of node i, or its maximum for left children
+	bool leftChild = false;		// true if the end of node i is only bounded by end
+	uint8_t depth = 0;
+
+	for (uint64_t i = 0; ; ++i)
+	{
+		const FlatNode& n = nodes[i];
+		if (n.begin != begin || n.end < n.begin || (leftChild ? n.end > end : n.end != end)) {
+			return false;
+		}
+
+		if (n.right)
+		{
+			if (n.right <= i + 1 || n.right >= numNodes || depth == flatTreeMaxDepth) {
+				return false;
+			}
+			stack.push_back(Pending{n.right, n.end, static_cast<uint8_t>(depth + 1)});
+			end = n.end;
+			leftChild = true;
+			++depth;
+		}
+		else
+		{
+			if (stack.empty()) {
+				return i + 1 == numNodes;
+			}
+			const Pending pending = stack.back();
+			stack.pop_back();
+			if (pending.right != i + 1) {
+				return false;
+			}
+			begin = n.end;
+			end = pending.end;
+			leftChild = false;
+			depth = pending.depth;
+		}
+	}
+}
+
+template <class T>
+uint64_t writeFlatTree(const std::vector<FlatNode>& nodes, const T* points, uint64_t numPoints, void* image)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "points must be copyable bitwise");
+
+	const FlatTreeHeader header = flatTreeHeader(nodes.size(), numPoints, sizeof(T));
+
+	if (image)
+	{
+		unsigned char* data = static_cast<unsigned char*>(image);
+		std::memcpy(data + header.nodesOffset, nodes.data(), nodes.size() * sizeof(FlatNode));
+		if (numPoints > 0) {
+			std::memcpy(data + header.pointsOffset, points, numPoints * sizeof(T));
+		}
+		std::memcpy(data + sizeof(header.magic), reinterpret_cast<const char*>(&header) + sizeof(header.magic),
+					sizeof(header) - sizeof(header.magic));
+
+		// readers check the magic bytes, publish them after everything else
+		std::atomic_thread_fence(std::memory_order_release);
+		std::memcpy(data, flatTreeMagic, sizeof(flatTreeMagic));
+	}
+
+	return header.size;
+}
+
+template <class T>
+bool readFlatTree(const void* image, uint64_t size, FlatTreeView<T>& view)
+{
+	view = FlatTreeView<T>();
+
+	if (!image || size < sizeof(FlatTreeHeader)
+		|| reinterpret_cast<uintptr_t>(image) % alignof(FlatNode) != 0
+		|| reinterpret_cast<uintptr_t>(image) % alignof(T) != 0) {
+		return false;
+	}
+
+	// writeFlatTree() publishes the magic bytes last. The acquire fence pairs
+	// with its release fence: once the magic bytes are seen, e.g. in shared
+	// memory, the header, nodes and points read after the fence are complete.
+	if (std::memcmp(image, flatTreeMagic, sizeof(flatTreeMagic)) != 0) {
+		return false;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	FlatTreeHeader header;
+	std::memcpy(&header, image, sizeof(header));
+
+	if (!validFlatTreeHeader(header, size, sizeof(T), alignof(T))) {
+		return false;
+	}
+
+	const unsigned char* data = static_cast<const unsigned char*>(image);
+	const FlatNode* nodes = reinterpret_cast<const FlatNode*>(data + header.nodesOffset);
+
+	if (!validFlatTreeNodes(nodes, header.numNodes, header.numPoints)) {
+		return false;
+	}
+
+	view = FlatTreeView<T>(nodes, header.numNodes,
+						   reinterpret_cast<const T*>(data + header.pointsOffset), header.numPoints);
+	return true;
+}
+
+}
+
+#endif // KDTREE_FLATTREE_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
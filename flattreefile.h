@@ -0,0 +1,200 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_FLATTREEFILE_H
+#define KDTREE_FLATTREEFILE_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <new>     // std::align_val_t
+#include <cstdint> // uint64_t
+
+#include "pointcloud.h"
+#include "flattree.h"
+
+namespace kdtree
+{
+
+/**
+ * Save the kdtree and the points of @p cloud as flat tree image to the file
+ * @p fileName. The file format is described in @p FlatTreeHeader. The image is
+ * streamed to the file, no copy of the cloud is made.
+ * @return true on success, false if the tree is not built, points were
+ *         inserted since the last PointCloud::compact(), or writing failed.
+ */
+template <class T, class Alloc>
+bool saveFlatTree(const std::string& fileName, const PointCloud<T, Alloc>& cloud);
+
+/**
+ * The class @p FlatTreeFile loads a kdtree saved with saveFlatTree().
+ *
+ * Loading reads the whole file sequentially into one buffer and validates
+ * it. Since the image only uses offsets, it is queried in place without
+ * rebuilding the tree or fixing up pointers.
+ */
+template <class T>
+class FlatTreeFile
+{
+public:
+	FlatTreeFile() = default;
+	FlatTreeFile(const FlatTreeFile&) = delete;
+	FlatTreeFile& operator=(const FlatTreeFile&) = delete;
+	~FlatTreeFile();
+
+	/**
+	 * Load the file @p fileName. The previously loaded tree is removed.
+	 * @return true on success, false if the file cannot be read or is invalid.
+	 */
+	bool load(const std::string& fileName);
+
+	/**
+	 * Remove the loaded tree.
+	 */
+	void clear();
+
+	/**
+	 * Find the @p k nearest points to given reference point @p p, see
+	 * PointCloud::findKNearest().
+	 * @return true on success, false if no tree is loaded.
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result) const;
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Find all points in the sphere with center @p m and @p radius, see
+	 * PointCloud::findInRadius().
+	 * @return true on success, false if no tree is loaded.
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result) const;
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Returns the loaded tree.
+	 */
+	const FlatTreeView<T>& tree() const;
+
+private:
+	static constexpr std::align_val_t alignment = std::align_val_t(64);
+
+	void* m_data = nullptr;
+	FlatTreeView<T> m_tree;
+};
+
+
+//
+//
+// TEMPLATE IMPLEMENTATION
+//
+//
+
+template <class T, class Alloc>
+bool saveFlatTree(const std::string& fileName, const PointCloud<T, Alloc>& cloud)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "points must be copyable bitwise");
+
+	std::vector<FlatNode> nodes;
+	if (!cloud.flatten(nodes)) {
+		return false;
+	}
+
+	std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+
+	const std::vector<T, Alloc>& points = cloud.points();
+	const FlatTreeHeader header = flatTreeHeader(nodes.size(), points.size(), sizeof(T));
+	const std::vector<char> padding(64, 0);
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(padding.data(), header.nodesOffset - sizeof(header));
+	file.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(FlatNode));
+	file.write(padding.data(), header.pointsOffset - header.nodesOffset - nodes.size() * sizeof(FlatNode));
+	file.write(reinterpret_cast<const char*>(points.data()), points.size() * sizeof(T));
+
+	return static_cast<bool>(file.flush());
+}
+
+template <class T>
+FlatTreeFile<T>::~FlatTreeFile()
+{
+	clear();
+}
+
+template <class T>
+bool FlatTreeFile<T>::load(const std::string& fileName)
+{
+	clear();
+
+	std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+	if (!file) {
+		return false;
+	}
+
+	const std::streamoff size = file.tellg();
+	if (size <= 0) {
+		return false;
+	}
+	file.seekg(0);
+
+	m_data = ::operator new(static_cast<size_t>(size), alignment);
+	if (!file.read(static_cast<char*>(m_data), size) || !readFlatTree(m_data, size, m_tree)) {
+		clear();
+		return false;
+	}
+
+	return true;
+}
+
+template <class T>
+void FlatTreeFile<T>::clear()
+{
+	if (m_data) {
+		::operator delete(m_data, alignment);
+	}
+
+	m_data = nullptr;
+	m_tree = FlatTreeView<T>();
+}
+
+template <class T>
+bool FlatTreeFile<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result) const
+{
+	return m_tree.findKNearest(p, k, result);
+}
+
+template <class T>
+bool FlatTreeFile<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const
+{
+	return m_tree.findKNearest(p, k, result, distances);
+}
+
+template <class T>
+bool FlatTreeFile<T>::findInRadius(const float* m, float radius2, std::vector<T>& result) const
+{
+	return m_tree.findInRadius(m, radius2, result);
+}
+
+template <class T>
+bool FlatTreeFile<T>::findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const
+{
+	return m_tree.findInRadius(m, radius2, result, distances);
+}
+
+template <class T>
+const FlatTreeView<T>& FlatTreeFile<T>::tree() const
+{
+	return m_tree;
+}
+
+}
+
+#endif // KDTREE_FLATTREEFILE_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -0,0 +1,56 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifdef WIN32
+#pragma warning(disable:4530)
+#define WIN32_CONSOLE
+#endif
+
+// Writes a synthetic point cloud created with kdtree::DatasetGenerator.
+//
+//   generate <distribution> <points> <file> [seed]
+//
+// The distribution is one of uniform, clusters, planes, lidar, duplicates or
+// anisotropic. The points are streamed to the file in blocks, so clouds of
+// 10^9 points (12 GB) need no more memory than clouds of 10^3 points. The
+// file is read with kdtree::readDataset().
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+
+#include "datasets.h"
+
+int main( int argc, char** argv )
+{
+	kdtree::Distribution distribution;
+	if (argc < 4 || !kdtree::distributionFromName(argv[1], distribution)) {
+		std::cerr << "usage: " << argv[0] << " <distribution> <points> <file> [seed]" << std::endl
+				  << "distributions:";
+		for (uint32_t i = 0; i < static_cast<uint32_t>(kdtree::Distribution::DistributionCount); ++i) {
+			std::cerr << " " << kdtree::distributionName(static_cast<kdtree::Distribution>(i));
+		}
+		std::cerr << std::endl;
+		return 1;
+	}
+
+	const uint64_t numPoints = std::strtoull(argv[2], nullptr, 10);
+	const uint64_t seed = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 42;
+
+	const auto start = std::chrono::steady_clock::now();
+	const kdtree::DatasetGenerator generator(distribution, numPoints, seed);
+	if (!kdtree::writeDataset(argv[3], generator)) {
+		std::cerr << "cannot write " << argv[3] << std::endl;
+		return 1;
+	}
+	const double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << numPoints << " points (" << kdtree::distributionName(distribution) << ", seed " << seed << ") "
+			  << "written to " << argv[3] << " in " << time << " s" << std::endl;
+	return 0;
+}
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -0,0 +1,235 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_HUGEPAGES_H
+#define KDTREE_HUGEPAGES_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <vector>
+#include <mutex>
+#include <cstdlib>
+#include <cstdint> // uintptr_t
+#include <cstddef> // size_t
+#include <new>     // std::bad_alloc
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace kdtree
+{
+
+/**
+ * size of a huge page on x86-64 and arm64 (with 4 KB base pages).
+ */
+static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+
+/**
+ * Allocate @p bytes of memory backed by huge pages, if possible.
+ *
+ * On Linux, this first tries explicit huge pages (MAP_HUGETLB), which requires
+ * reserved pages in /proc/sys/vm/nr_hugepages. If that fails, a 2 MB aligned
+ * anonymous mapping is advised to use transparent huge pages (MADV_HUGEPAGE).
+ * On other systems, plain std::malloc() is used.
+ * @param bytes amount of bytes, rounded up to a multiple of @p hugePageSize
+ * @return the memory, free with freeHugePages() and the same @p bytes
+ */
+inline void* allocateHugePages(size_t bytes)
+{
+	bytes = (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+
+#ifdef __linux__
+#ifdef MAP_HUGETLB
+	void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mem != MAP_FAILED) {
+		return mem;
+	}
+#endif
+
+	// over-allocate, such that the huge page aligned part can be kept
+	char* raw = static_cast<char*>(mmap(nullptr, bytes + hugePageSize, PROT_READ | PROT_WRITE,
+										MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (raw == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+
+	char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + hugePageSize - 1) / hugePageSize * hugePageSize);
+	if (aligned != raw) {
+		munmap(raw, aligned - raw);
+	}
+	munmap(aligned + bytes, raw + hugePageSize - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+	return aligned;
+#else
+	void* mem = std::malloc(bytes);
+	if (!mem) {
+		throw std::bad_alloc();
+	}
+	return mem;
+#endif
+}
+
+/**
+ * Free memory allocated with allocateHugePages().
+ */
+inline void freeHugePages(void* mem, size_t bytes)
+{
+#ifdef __linux__
+	bytes = (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+	munmap(mem, bytes);
+#else
+	(void)bytes;
+	std::free(mem);
+#endif
+}
+
+/**
+ * Advise the kernel to back the existing buffer @p mem of size @p bytes with
+ * transparent huge pages. Only the huge page aligned interior of the buffer
+ * is affected. Does nothing on systems without transparent huge pages.
+ */
+inline void adviseHugePages(const void* mem, size_t bytes)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	const uintptr_t begin = (reinterpret_cast<uintptr_t>(mem) + hugePageSize - 1) / hugePageSize * hugePageSize;
+	const uintptr_t end = (reinterpret_cast<uintptr_t>(mem) + bytes) / hugePageSize * hugePageSize;
+	if (begin < end) {
+		madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+	}
+#else
+	(void)mem;
+	(void)bytes;
+#endif
+}
+
+/**
+ * The class @p HugePageAllocator is a standard allocator that places large
+ * allocations in huge pages, see allocateHugePages(). Allocations smaller
+ * than half a huge page use operator new to avoid wasting memory.
+ */
+template <class T>
+class HugePageAllocator
+{
+public:
+	using value_type = T;
+
+	constexpr HugePageAllocator() noexcept = default;
+	template <class U>
+	constexpr HugePageAllocator(const HugePageAllocator<U>&) noexcept {}
+
+	T* allocate(size_t n)
+	{
+		const size_t bytes = n * sizeof(T);
+		if (bytes < hugePageSize / 2) {
+			return static_cast<T*>(::operator new(bytes));
+		}
+		return static_cast<T*>(allocateHugePages(bytes));
+	}
+
+	void deallocate(T* mem, size_t n) noexcept
+	{
+		const size_t bytes = n * sizeof(T);
+		if (bytes < hugePageSize / 2) {
+			::operator delete(mem);
+		} else {
+			freeHugePages(mem, bytes);
+		}
+	}
+
+	template <class U>
+	constexpr bool operator==(const HugePageAllocator<U>&) const noexcept { return true; }
+	template <class U>
+	constexpr bool operator!=(const HugePageAllocator<U>&) const noexcept { return false; }
+};
+
+/**
+ * The class @p HugePagePool provides storage for objects of type @p T in
+ * chunks of one huge page each. Freed slots are reused by later allocations.
+ * The pool does not construct or destruct objects. allocate() and
+ * deallocate() may be called from several threads at once, e.g. when lazily
+ * built nodes are split by concurrent queries.
+ */
+template <class T>
+class HugePagePool
+{
+public:
+	HugePagePool() = default;
+	HugePagePool(const HugePagePool&) = delete;
+	HugePagePool& operator=(const HugePagePool&) = delete;
+	~HugePagePool();
+
+	/**
+	 * Returns uninitialized storage for one @p T.
+	 */
+	void* allocate();
+
+	/**
+	 * Return the storage @p mem obtained by allocate() to the pool.
+	 */
+	void deallocate(void* mem) noexcept;
+
+private:
+	union Slot
+	{
+		Slot* next;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	static constexpr size_t slotsPerChunk = hugePageSize / sizeof(Slot);
+
+	std::mutex m_mutex;
+	std::vector<Slot*> m_chunks;
+	Slot* m_free = nullptr;
+};
+
+template <class T>
+HugePagePool<T>::~HugePagePool()
+{
+	for (Slot* chunk : m_chunks) {
+		freeHugePages(chunk, hugePageSize);
+	}
+}
+
+template <class T>
+void* HugePagePool<T>::allocate()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_free)
+	{
+		Slot* chunk = static_cast<Slot*>(allocateHugePages(hugePageSize));
+		m_chunks.push_back(chunk);
+
+		for (size_t i = 0; i + 1 < slotsPerChunk; ++i) {
+			chunk[i].next = &chunk[i + 1];
+		}
+		chunk[slotsPerChunk - 1].next = nullptr;
+		m_free = chunk;
+	}
+
+	Slot* slot = m_free;
+	m_free = slot->next;
+	return slot;
+}
+
+template <class T>
+void HugePagePool<T>::deallocate(void* mem) noexcept
+{
+	Slot* slot = static_cast<Slot*>(mem);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	slot->next = m_free;
+	m_free = slot;
+}
+
+}
+
+#endif // KDTREE_HUGEPAGES_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
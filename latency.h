@@ -0,0 +1,469 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_LATENCY_H
+#define KDTREE_LATENCY_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cmath>   // std::ceil
+#include <bit>     // std::countl_zero
+#include <cstdint> // uint64_t
+
+namespace kdtree
+{
+
+/**
+ * The class @p LatencyHistogram counts latencies in nanoseconds in
+ * logarithmic buckets, like an HDR histogram: each power of two is split into
+ * 16 linear buckets, so percentiles are accurate to 6.25% for all values up
+ * to 2^64 ns with 8 KB of counters. Histograms of several threads or
+ * processes are merged by adding the counters.
+ */
+class LatencyHistogram
+{
+public:
+	static constexpr unsigned int subBuckets = 16;
+	static constexpr unsigned int bucketCount = 61 * subBuckets;
+
+	/**
+	 * Returns the bucket of the latency @p ns.
+	 */
+	static unsigned int bucket(uint64_t ns);
+
+	/**
+	 * Returns the biggest latency that falls into bucket @p index.
+	 */
+	static uint64_t bucketLimit(unsigned int index);
+
+	/**
+	 * Count the latency @p ns.
+	 */
+	void record(uint64_t ns);
+
+	/**
+	 * Add the counts of @p other to this histogram.
+	 */
+	void merge(const LatencyHistogram& other);
+
+	/**
+	 * Returns the amount of recorded latencies.
+	 */
+	uint64_t count() const;
+
+	/**
+	 * Returns the mean latency in ns, or 0 if nothing was recorded.
+	 */
+	double mean() const;
+
+	/**
+	 * Returns the biggest recorded latency in ns.
+	 */
+	uint64_t max() const;
+
+	/**
+	 * Returns the latency in ns that @p percent percent of all latencies do
+	 * not exceed, e.g. percentile(99.9). The value is the upper limit of its
+	 * bucket, but never bigger than max().
+	 */
+	uint64_t percentile(double percent) const;
+
+	/**
+	 * Returns the count of bucket @p index.
+	 */
+	uint64_t countInBucket(unsigned int index) const;
+
+	/**
+	 * Returns a line with count, mean, percentiles and max, prefixed by @p name.
+	 */
+	std::string toText(const std::string& name) const;
+
+	/**
+	 * Returns a JSON object with count, mean, percentiles, max and the
+	 * non-empty buckets as [limit, count] pairs, such that histograms can be
+	 * merged by other tools.
+	 */
+	std::string toJson() const;
+
+private:
+	friend class ThreadLatency;
+
+	uint64_t m_counts[bucketCount] = {};
+	uint64_t m_count = 0;
+	uint64_t m_sum = 0;
+	uint64_t m_max = 0;
+};
+
+/**
+ * The struct @p LatencyHistograms holds one histogram per measured operation.
+ */
+struct LatencyHistograms
+{
+	enum Operation {
+		RebuildTree = 0,		///< PointCloud::rebuildTree()
+		FindKNearest,			///< PointCloud::findKNearest()
+		FindInRadius,			///< PointCloud::findInRadius()
+		FindInRadiusBatch,		///< PointCloud::findInRadius() for a batch, the whole call
+		FindNearestBatch,		///< PointCloud::findNearest() for a batch, the whole call
+		AnyWithinRadiusBatch,	///< PointCloud::anyWithinRadius() for a batch, the whole call
+		OperationCount
+	};
+
+	LatencyHistogram histograms[OperationCount];
+
+	/**
+	 * Returns the name of @p operation, e.g. "findKNearest".
+	 */
+	static const char* name(Operation operation);
+
+	/**
+	 * Add the counts of @p other to these histograms.
+	 */
+	void merge(const LatencyHistograms& other);
+
+	/**
+	 * Returns one line per operation, see LatencyHistogram::toText().
+	 */
+	std::string toText() const;
+
+	/**
+	 * Returns a JSON object with one member per operation.
+	 */
+	std::string toJson() const;
+};
+
+/**
+ * Returns the latency histograms of all threads merged, including threads
+ * that already exited. The histograms are only filled if the library is
+ * compiled with KDTREE_LATENCY_HISTOGRAMS defined.
+ */
+inline LatencyHistograms latencyHistograms();
+
+/**
+ * Returns the latency histograms of the calling thread.
+ */
+inline LatencyHistograms threadLatencyHistograms();
+
+/**
+ * The class @p ThreadLatency holds the counters of one thread. Only the
+ * owning thread writes them, without atomic read-modify-write instructions,
+ * other threads may read them at any time for a snapshot.
+ */
+class ThreadLatency
+{
+public:
+	ThreadLatency();
+	~ThreadLatency();
+
+	/**
+	 * Returns the counters of the calling thread.
+	 */
+	static ThreadLatency& current();
+
+	/**
+	 * Count the latency @p ns of @p operation.
+	 */
+	void record(LatencyHistograms::Operation operation, uint64_t ns);
+
+	/**
+	 * Add the counters to @p histograms.
+	 */
+	void addTo(LatencyHistograms& histograms) const;
+
+private:
+	struct Counters
+	{
+		std::atomic<uint64_t> counts[LatencyHistogram::bucketCount];
+		std::atomic<uint64_t> sum;
+		std::atomic<uint64_t> max;
+	};
+
+	Counters m_counters[LatencyHistograms::OperationCount] = {};
+};
+
+/**
+ * The class @p LatencyTimer records the time from its construction to its
+ * destruction in the histogram of an operation of the calling thread.
+ */
+class LatencyTimer
+{
+public:
+	explicit LatencyTimer(LatencyHistograms::Operation operation);
+	~LatencyTimer();
+
+private:
+	LatencyHistograms::Operation m_operation;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+#ifdef KDTREE_LATENCY_HISTOGRAMS
+#define KDTREE_MEASURE_LATENCY(operation) kdtree::LatencyTimer kdtreeLatencyTimer(kdtree::LatencyHistograms::operation)
+#else
+#define KDTREE_MEASURE_LATENCY(operation)
+#endif
+
+
+//
+//
+// IMPLEMENTATION
+//
+//
+
+inline unsigned int LatencyHistogram::bucket(uint64_t ns)
+{
+	if (ns < subBuckets) {
+		return static_cast<unsigned int>(ns);
+	}
+
+	// exponent >= 4, the 4 bits below the leading bit select the sub bucket
+	const unsigned int exponent = 63 - std::countl_zero(ns);
+	const unsigned int sub = static_cast<unsigned int>(ns >> (exponent - 4)) & (subBuckets - 1);
+	return (exponent - 3) * subBuckets + sub;
+}
+
+inline uint64_t LatencyHistogram::bucketLimit(unsigned int index)
+{
+	if (index < subBuckets) {
+		return index;
+	}
+
+	const unsigned int exponent = index / subBuckets + 3;
+	const uint64_t sub = index % subBuckets;
+	const uint64_t width = uint64_t(1) << (exponent - 4);
+	return ((subBuckets + sub) << (exponent - 4)) + (width - 1);
+}
+
+inline void LatencyHistogram::record(uint64_t ns)
+{
+	++m_counts[bucket(ns)];
+	++m_count;
+	m_sum += ns;
+	m_max = std::max(m_max, ns);
+}
+
+inline void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+	for (unsigned int i = 0; i < bucketCount; ++i) {
+		m_counts[i] += other.m_counts[i];
+	}
+	m_count += other.m_count;
+	m_sum += other.m_sum;
+	m_max = std::max(m_max, other.m_max);
+}
+
+inline uint64_t LatencyHistogram::count() const
+{
+	return m_count;
+}
+
+inline double LatencyHistogram::mean() const
+{
+	return m_count ? static_cast<double>(m_sum) / m_count : 0.0;
+}
+
+inline uint64_t LatencyHistogram::max() const
+{
+	return m_max;
+}
+
+inline uint64_t LatencyHistogram::percentile(double percent) const
+{
+	const uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percent / 100.0 * m_count)));
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < bucketCount; ++i)
+	{
+		seen += m_counts[i];
+		if (seen >= target) {
+			return std::min(bucketLimit(i), m_max);
+		}
+	}
+	return m_max;
+}
+
+inline uint64_t LatencyHistogram::countInBucket(unsigned int index) const
+{
+	return m_counts[index];
+}
+
+inline std::string LatencyHistogram::toText(const std::string& name) const
+{
+	return name + ": count " + std::to_string(m_count)
+		 + ", mean " + std::to_string(static_cast<uint64_t>(mean())) + " ns"
+		 + ", p50 " + std::to_string(percentile(50.0))
+		 + ", p90 " + std::to_string(percentile(90.0))
+		 + ", p99 " + std::to_string(percentile(99.0))
+		 + ", p99.9 " + std::to_string(percentile(99.9))
+		 + ", max " + std::to_string(m_max) + "\n";
+}
+
+inline std::string LatencyHistogram::toJson() const
+{
+	std::string json = "{\"count\": " + std::to_string(m_count)
+					 + ", \"mean\": " + std::to_string(mean())
+					 + ", \"p50\": " + std::to_string(percentile(50.0))
+					 + ", \"p90\": " + std::to_string(percentile(90.0))
+					 + ", \"p99\": " + std::to_string(percentile(99.0))
+					 + ", \"p99.9\": " + std::to_string(percentile(99.9))
+					 + ", \"max\": " + std::to_string(m_max)
+					 + ", \"buckets\": [";
+
+	bool first = true;
+	for (unsigned int i = 0; i < bucketCount; ++i)
+	{
+		if (m_counts[i]) {
+			json += (first ? "[" : ", [") + std::to_string(bucketLimit(i)) + ", " + std::to_string(m_counts[i]) + "]";
+			first = false;
+		}
+	}
+	return json + "]}";
+}
+
+inline const char* LatencyHistograms::name(Operation operation)
+{
+	switch (operation) {
+		case RebuildTree: return "rebuildTree";
+		case FindKNearest: return "findKNearest";
+		case FindInRadius: return "findInRadius";
+		case FindInRadiusBatch: return "findInRadiusBatch";
+		case FindNearestBatch: return "findNearestBatch";
+		case AnyWithinRadiusBatch: return "anyWithinRadiusBatch";
+		default: return "unknown";
+	}
+}
+
+inline void LatencyHistograms::merge(const LatencyHistograms& other)
+{
+	for (int i = 0; i < OperationCount; ++i) {
+		histograms[i].merge(other.histograms[i]);
+	}
+}
+
+inline std::string LatencyHistograms::toText() const
+{
+	std::string text;
+	for (int i = 0; i < OperationCount; ++i) {
+		text += histograms[i].toText(name(static_cast<Operation>(i)));
+	}
+	return text;
+}
+
+inline std::string LatencyHistograms::toJson() const
+{
+	std::string json = "{";
+	for (int i = 0; i < OperationCount; ++i) {
+		json += std::string(i ? ", \"" : "\"") + name(static_cast<Operation>(i)) + "\": " + histograms[i].toJson();
+	}
+	return json + "}";
+}
+
+/**
+ * the counters of all running threads, and the sum of all exited threads
+ */
+struct LatencyRegistry
+{
+	std::mutex mutex;
+	std::vector<const ThreadLatency*> threads;
+	LatencyHistograms exited;
+
+	static LatencyRegistry& instance()
+	{
+		static LatencyRegistry registry;
+		return registry;
+	}
+};
+
+inline ThreadLatency::ThreadLatency()
+{
+	LatencyRegistry& registry = LatencyRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.threads.push_back(this);
+}
+
+inline ThreadLatency::~ThreadLatency()
+{
+	LatencyRegistry& registry = LatencyRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	addTo(registry.exited);
+	registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+}
+
+inline ThreadLatency& ThreadLatency::current()
+{
+	static thread_local ThreadLatency latency;
+	return latency;
+}
+
+inline void ThreadLatency::record(LatencyHistograms::Operation operation, uint64_t ns)
+{
+	// only this thread writes, so load and store suffice
+	Counters& c = m_counters[operation];
+	std::atomic<uint64_t>& count = c.counts[LatencyHistogram::bucket(ns)];
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	c.sum.store(c.sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	if (ns > c.max.load(std::memory_order_relaxed)) {
+		c.max.store(ns, std::memory_order_relaxed);
+	}
+}
+
+inline void ThreadLatency::addTo(LatencyHistograms& histograms) const
+{
+	for (int op = 0; op < LatencyHistograms::OperationCount; ++op)
+	{
+		const Counters& c = m_counters[op];
+		LatencyHistogram& h = histograms.histograms[op];
+		for (unsigned int i = 0; i < LatencyHistogram::bucketCount; ++i)
+		{
+			const uint64_t n = c.counts[i].load(std::memory_order_relaxed);
+			h.m_counts[i] += n;
+			h.m_count += n;
+		}
+		h.m_sum += c.sum.load(std::memory_order_relaxed);
+		h.m_max = std::max(h.m_max, c.max.load(std::memory_order_relaxed));
+	}
+}
+
+inline LatencyTimer::LatencyTimer(LatencyHistograms::Operation operation)
+	: m_operation(operation)
+	, m_start(std::chrono::steady_clock::now())
+{
+}
+
+inline LatencyTimer::~LatencyTimer()
+{
+	const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+	ThreadLatency::current().record(m_operation, static_cast<uint64_t>(ns));
+}
+
+inline LatencyHistograms latencyHistograms()
+{
+	LatencyRegistry& registry = LatencyRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	LatencyHistograms histograms = registry.exited;
+	for (const ThreadLatency* thread : registry.threads) {
+		thread->addTo(histograms);
+	}
+	return histograms;
+}
+
+inline LatencyHistograms threadLatencyHistograms()
+{
+	LatencyHistograms histograms;
+	ThreadLatency::current().addTo(histograms);
+	return histograms;
+}
+
+}
+
+#endif // KDTREE_LATENCY_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
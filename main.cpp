@@ -13,14 +13,16 @@ SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
 #include "pointcloud.h"
 #include "point.h"
 
-// Derive a point class from kdtree::Point.
+// Derive a point class from kdtree::SlimPoint (coordinates only) or
+// kdtree::Point (additionally stores the distance in query results).
+// Existing point types work without deriving by specializing kdtree::PointTraits.
 // - Pass the x/y/z position via constructor.
 // - You can freely add additional member data, for example setVariance() and variance().
-class MyPoint : public kdtree::Point
+class MyPoint : public kdtree::SlimPoint
 {
 public:
 	constexpr MyPoint(float x, float y, float z) noexcept
-		: kdtree::Point(x, y, z)
+		: kdtree::SlimPoint(x, y, z)
 	{
 	}
 
@@ -76,9 +78,25 @@ int main( int argc, char** argv )
 	pointCloud.findInRadius(p, squareRadius, result);
 	std::cout << "found " << result.size() << " items in radius." << std::endl;
 
-	// find 10 closest points around p
-	pointCloud.findKNearest(p, 10, result);
-	std::cout << "found " << result.size() << " nearest items." << std::endl;
+	// visit points in radius without copying them, stop after the first 5 points
+	int visited = 0;
+	pointCloud.visitInRadius(p, squareRadius, [&](uint64_t index, float distance2) {
+		std::cout << "point " << index << " at square distance " << distance2 << std::endl;
+		return ++visited < 5;
+	});
+
+	// find 10 closest points around p, with their square distances
+	std::vector<float> distances;
+	pointCloud.findKNearest(p, 10, result, distances);
+	std::cout << "found " << result.size() << " nearest items, the farthest at square distance "
+			  << distances.back() << "." << std::endl;
+
+	// points can also be inserted into an existing kdtree without rebuilding it
+	for (int a = 0; a < 100; ++a) {
+		pointCloud.insertItem(MyPoint(0.1f * a, 0.5f, 0.5f));
+	}
+	pointCloud.findInRadius(p, squareRadius, result);
+	std::cout << "found " << result.size() << " items in radius after insertion." << std::endl;
 
 	return 0;
 }
@@ -0,0 +1,105 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_NEIGHBORS_H
+#define KDTREE_NEIGHBORS_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <utility> // std::pair
+#include <cstdint> // uint64_t
+
+namespace kdtree
+{
+
+/**
+ * Set the member @p dist of @p point to @p d, if the point type has one.
+ * Query results are copies, so this never changes the stored points.
+ */
+template <class T>
+inline auto setDistance(T& point, float d, int) -> decltype(point.dist = d, void())
+{
+	point.dist = d;
+}
+
+template <class T>
+inline void setDistance(T&, float, long)
+{
+}
+
+template <class T>
+inline void setDistance(T& point, float d)
+{
+	setDistance(point, d, 0);
+}
+
+/**
+ * Sort the points @p result and their square distances @p distances by
+ * distance.
+ */
+template <class T>
+inline void sortNearest(std::vector<T>& result, std::vector<float>& distances)
+{
+	std::vector<std::pair<float, uint64_t>> order(result.size());
+	for (uint64_t i = 0; i < result.size(); ++i) {
+		order[i] = std::make_pair(distances[i], i);
+	}
+	std::sort(order.begin(), order.end());
+
+	std::vector<T> sorted;
+	sorted.reserve(result.size());
+	for (uint64_t i = 0; i < order.size(); ++i) {
+		sorted.push_back(result[order[i].second]);
+		distances[i] = order[i].first;
+	}
+	result.swap(sorted);
+}
+
+/**
+ * Insert @p point with square distance @p d into the @p k nearest points
+ * @p result and their square distances @p distances. The first k - 1 points
+ * are appended unsorted, with the k-th point both vectors are sorted once.
+ * Afterwards, points are inserted sorted. If less than k points are found in
+ * total, call sortNearest() at the end.
+ * @return the new bound: the square distance of the k-th nearest point, or
+ *         the largest float if less than @p k points were found so far.
+ */
+template <class T>
+inline float insertNearest(std::vector<T>& result, std::vector<float>& distances, unsigned int k, const T& point, float d)
+{
+	if (result.size() < k)
+	{
+		result.push_back(point);
+		distances.push_back(d);
+		setDistance(result.back(), d);
+		if (result.size() < k) {
+			return std::numeric_limits<float>::max();
+		}
+
+		// happens exactly once
+		sortNearest(result, distances);
+		return distances.back();
+	}
+
+	// size == k, insert sorted, and remove last
+	const uint64_t i = std::upper_bound(distances.begin(), distances.end(), d) - distances.begin();
+	result.pop_back();
+	distances.pop_back();
+	result.insert(result.begin() + i, point);
+	distances.insert(distances.begin() + i, d);
+	setDistance(result[i], d);
+
+	return distances.back();
+}
+
+}
+
+#endif // KDTREE_NEIGHBORS_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -11,22 +11,70 @@ SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
 
 #include <vector>
 #include <algorithm>
+#include <memory> // std::allocator
+#include <array>
+#include <future> // std::async
+#include <atomic>
+#include <mutex>
+#include <bit> // std::countr_zero
+#include <cmath> // std::fabs
 
 #include "point.h"
 #include "boundingbox.h"
+#include "hugepages.h"
+#include "neighbors.h"
+#include "trace.h"
+#include "querycounters.h"
 
 namespace kdtree
 {
 
-template <class T> class PointCloud;
+template <class T, class Alloc> class PointCloud;
+
+/**
+ * The struct @p QueryPacket holds up to @p size query points of a batch query,
+ * which traverse the tree together. The coordinates are stored per axis, so
+ * that all queries are processed at once with SIMD instructions.
+ */
+struct QueryPacket
+{
+	static constexpr unsigned int size = 16;
+
+	float x[size];			///< x coordinates of the queries
+	float y[size];			///< y coordinates of the queries
+	float z[size];			///< z coordinates of the queries
+	uint64_t index[size];	///< index of the queries in the batch
+	unsigned int count;		///< amount of valid queries
+	float p[3];				///< smallest query coordinates
+	float q[3];				///< biggest query coordinates
+
+	/**
+	 * Fill the packet with the queries @p first, @p first + 1, ... of the
+	 * @p count queries @p queries (3 floats each). Unused lanes repeat the
+	 * first query.
+	 */
+	void set(const float* queries, uint64_t first, uint64_t count);
+};
+
+/**
+ * The struct @p QuerySample holds sample query points, e.g. recorded in
+ * production, that guide the leaf sizes of a kdtree, see
+ * PointCloud::rebuildTree(const float*, uint64_t).
+ */
+struct QuerySample
+{
+	std::vector<std::array<float, 3>> queries;	///< the query points, reordered during the build
+	float density;								///< amount of queries per point in the whole cloud
+};
 
 /**
  * The class @p Node arranges efficient space partitions for the
  * amount of points. The space is stored in a @p BoundingBox.
+ * The points live in a std::vector with the allocator @p Alloc.
  */
-template <class T> class Node
+template <class T, class Alloc = std::allocator<T>> class Node
 {
-	friend class PointCloud<T>;
+	friend class PointCloud<T, Alloc>;
 public:
 	/**
 	 * Constructor. Bound interval is: [begin; end) (halb-offen!!!)
@@ -34,10 +82,42 @@ public:
 	 * @param points the points
 	 * @param begin start of points
 	 * @param end end of points
+	 * @param pool if non-null, all nodes of the tree are allocated from @p pool
+	 * @param lazy if true, the node splits on the first call of expand()
+	 *        instead of right away, and so do its children
+	 * @param overflow indices of inserted points outside of [begin; end) that
+	 *        belong to this node, see insert()
 	 */
-	Node(std::vector<T>& points, uint64_t begin, uint64_t end);
+	Node(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool = nullptr,
+		 bool lazy = false, std::vector<uint64_t> overflow = {});
 	~Node();
 
+	/**
+	 * Constructor that splits finer where the queries @p first, ...,
+	 * @p last - 1 of @p sample concentrate: leaves get smaller where the
+	 * queries are denser than the points, and bigger where they are sparser.
+	 * The queries are reordered such that each child gets those in its half.
+	 */
+	Node(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool,
+		 QuerySample& sample, uint64_t first, uint64_t last);
+
+	/**
+	 * Allocate a node either from @p pool, or via new if @p pool is null.
+	 */
+	static Node<T, Alloc>* create(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool,
+								  bool lazy = false, std::vector<uint64_t> overflow = {});
+
+	/**
+	 * Allocate a node for the query @p sample, see the constructor.
+	 */
+	static Node<T, Alloc>* create(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool,
+								  QuerySample& sample, uint64_t first, uint64_t last);
+
+	/**
+	 * Delete a node created with create(). Does nothing for a null @p node.
+	 */
+	static void destroy(Node<T, Alloc>* node);
+
 	/**
 	 * Returns, whether the node is a leaf or not. A leaf does not
 	 * have further children and thus contains the data.
@@ -46,37 +126,195 @@ public:
 	 */
 	inline bool isLeaf() const;
 
+	/**
+	 * Split a lazy node into its children, if not done yet. All queries call
+	 * this before they descend, such that only the queried part of the tree
+	 * is built. Thread-safe: concurrent queries split each node once, the
+	 * points of other nodes are not touched.
+	 */
+	inline void expand() const;
+
+	/**
+	 * Returns the amount of points in this node, including all children and
+	 * inserted points.
+	 */
+	inline uint64_t size() const;
+
+	/**
+	 * insert the point @p item into the tree. The point is appended to the
+	 * point vector, and the leaf it is sorted into keeps its index in an
+	 * overflow list. No other point moves, so an insertion costs O(log n).
+	 *
+	 * If the insertion leaves a node weight-unbalanced, i.e. one of its children
+	 * holds more than @p alpha times the points of the node, the topmost such
+	 * node (the scapegoat) is rebuilt from its points. This keeps the height of
+	 * the tree logarithmic (amortized) for arbitrary insertion orders.
+	 * @param item the point to insert
+	 */
+	void insert(const T& item);
+
+	/**
+	 * Returns the amount of inserted points in the overflow lists of this
+	 * node and all children, see insert().
+	 */
+	inline uint64_t inserted() const;
+
+	/**
+	 * copy the points of this node and all children from @p from to the end
+	 * of @p to in tree order, such that the point interval of every node
+	 * includes its inserted points again. The overflow lists become empty.
+	 */
+	void compact(const std::vector<T, Alloc>& from, std::vector<T, Alloc>& to);
+
+	/**
+	 * recompute the bounding boxes of this node and all children bottom-up
+	 * from the current point coordinates. The tree structure and the order of
+	 * the points stay unchanged.
+	 * @param parallel amount of top levels that refit their left subtree
+	 *        with std::async, 0 for a single thread
+	 * @return the cost of the node, see cost()
+	 */
+	double refit(unsigned int parallel);
+
+	/**
+	 * Returns the sum of the surface areas of the bounding boxes of this node
+	 * and all children. The smaller, the less nodes a query visits.
+	 */
+	double cost() const;
+
 	/**
 	 * find the @p k nearest points to given reference point @p p. The result
-	 * will be stored in the vector @p result.
+	 * will be stored in the vector @p result, sorted by distance.
 	 * @param p reference point
 	 * @param k amount of points to find
 	 * @param result returned vector containing the points
+	 * @param distances returned square distances of the points in @p result
+	 * @param bound square distance of the k-th nearest point found so far
 	 */
-	void findKNearest(const float* p, const unsigned int k, std::vector<T>& result);
+	void findKNearest(const float* p, const unsigned int k, std::vector<T>& result,
+					  std::vector<float>& distances, float& bound) const;
 
 	/**
 	 * find all points in the sphere with center @p m and @p radius. The result
 	 * will be stored in the vector @p result.
 	 * @param m center of sphere
-	 * @param radius radius of sphere
+	 * @param radius2 square radius of sphere
 	 * @param result returned vector containing the points
+	 * @param distances returned square distances of the points in @p result
+	 */
+	void findInRadius(const float* m, const float radius2, std::vector<T>& result,
+					  std::vector<float>& distances) const;
+
+	/**
+	 * call @p visitor for all points in the sphere with center @p m and square
+	 * radius @p radius2, leaf by leaf during the traversal.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @param visitor callable as bool visitor(uint64_t index, float distance2),
+	 *        where index refers to the point vector. Returning false stops the traversal.
+	 * @return false, if the visitor stopped the traversal
+	 */
+	template <class Visitor>
+	bool visitInRadius(const float* m, const float radius2, Visitor&& visitor) const;
+
+	/**
+	 * find all points in the spheres with square radius @p radius2 around the
+	 * queries of @p packet. The packet descends the tree once, the bit mask
+	 * @p active tracks which queries still overlap the current node.
+	 * @param packet the query points
+	 * @param active bit i is set, if query i of the packet overlaps this node
+	 * @param radius2 square radius of the spheres
+	 * @param results returned points, indexed by QueryPacket::index
+	 * @param distances returned square distances of the points in @p results
 	 */
-	void findInRadius(const float* m, const float radius, std::vector<T>& result);
+	void findInRadius(const QueryPacket& packet, uint32_t active, const float radius2,
+					  std::vector<std::vector<T>>& results, std::vector<std::vector<float>>& distances) const;
+
+	/**
+	 * find the nearest point for each query of @p packet. The packet descends
+	 * the tree once, each query only follows nodes closer than its own best
+	 * distance.
+	 * @param packet the query points
+	 * @param active bit i is set, if query i of the packet may find a closer point in this node
+	 * @param best2 per query: square distance of the nearest point found so far
+	 * @param nearest per query: index of the nearest point found so far
+	 */
+	void findNearest(const QueryPacket& packet, uint32_t active, float* best2, uint64_t* nearest) const;
 
 private:
+	/**
+	 * Returns the bit mask of the queries of @p packet whose square distance
+	 * to the box is smaller than their @p bound2. All lanes are computed
+	 * without branches, so the loop vectorizes.
+	 */
+	uint32_t closerLanes(const QueryPacket& packet, const float* bound2) const;
+
+	/**
+	 * split the node into two children if it contains more than @p N points.
+	 * The children split recursively, or on expand() in a lazy tree.
+	 */
+	void split();
+
+	/**
+	 * split the node like split(), but with a leaf size that depends on the
+	 * queries @p first, ..., @p last - 1 of @p sample in this node.
+	 */
+	void split(QuerySample& sample, uint64_t first, uint64_t last);
+
+	/**
+	 * split a node with inserted points: the points of the interval and the
+	 * overflow list are partitioned by the same plane, each child gets half
+	 * of all points.
+	 */
+	void splitOverflow();
+
+	/**
+	 * drop all children and split the node again from its points. In a lazy
+	 * tree, the split waits for the next expand().
+	 */
+	void rebuild();
+
+	/**
+	 * append the overflow lists of all leaves of this node to @p overflow.
+	 */
+	void collectOverflow(std::vector<uint64_t>& overflow) const;
+
+	/**
+	 * crop the bounding box to the points of the interval and the overflow list.
+	 */
+	void crop();
+
+	/**
+	 * call @p f(i) for the index i of each point of this leaf, first for the
+	 * interval, then for the overflow list. Stops if @p f returns false.
+	 * @return false, if @p f stopped the scan
+	 */
+	template <class F>
+	inline bool scan(F&& f) const;
+
 	// children
-	Node<T>* left = nullptr;
-	Node<T>* right = nullptr;
+	Node<T, Alloc>* left = nullptr;
+	Node<T, Alloc>* right = nullptr;
 
 	// contains index of model points
-	std::vector <T>& m_points;
+	std::vector<T, Alloc>& m_points;
 
 	BoundingBox<T> box;
 
 	uint64_t m_begin;
 	uint64_t m_end;
 
+	// inserted points: indices in the leaf, amount in the subtree
+	std::vector<uint64_t> m_overflow;
+	uint64_t m_inserted;
+
+	// node storage, or nullptr for new/delete
+	HugePagePool<Node<T, Alloc>>* m_pool;
+
+	// lazy build: split on first expand(), see m_expanded
+	bool m_lazy;
+	mutable std::atomic<bool> m_expanded;
+
 	/**
 	 * global which indicates how many points are in a Node.
 	 * If there are more than @p N points the Node splits itself into
@@ -85,9 +323,16 @@ private:
 	static constexpr uint64_t N = 50;
 
 	/**
-	 * global distance to the most far away point as !square! (means: 2-Norm^2)
+	 * range of the leaf sizes of a kdtree built for a query sample.
+	 */
+	static constexpr uint64_t minLeafSize = 16;
+	static constexpr uint64_t maxLeafSize = 8 * N;
+
+	/**
+	 * weight-balance criterion for insert(): no child may hold more than
+	 * alpha times the points of its parent. Must be in [0.5; 1).
 	 */
-	static float dist;
+	static constexpr float alpha = 0.7f;
 };
 
 
@@ -97,9 +342,6 @@ private:
 //
 //
 
-template <class T>
-float Node<T>::dist = 1000000000.0f;
-
 /**
  * define comparator '<' needed by std::nth_element()
  */
@@ -111,124 +353,679 @@ public:
 	constexpr SortAxisComparator(int sortAxis) noexcept : m_sortAxis(sortAxis) {}
 	inline bool operator()(const T& a, const T& b)
 	{
-		return a.p[m_sortAxis] < b.p[m_sortAxis];
+		return pointCoordinate(a, m_sortAxis) < pointCoordinate(b, m_sortAxis);
 	}
 };
 
-template <class T>
-Node<T>::Node(std::vector<T>& points, uint64_t begin, uint64_t end)
+template <class T, class Alloc>
+Node<T, Alloc>::Node(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool,
+					 bool lazy, std::vector<uint64_t> overflow)
 	: m_points(points)
 	, m_begin(begin)
 	, m_end(end)
+	, m_overflow(std::move(overflow))
+	, m_inserted(m_overflow.size())
+	, m_pool(pool)
+	, m_lazy(lazy)
+	, m_expanded(!lazy)
+{
+	KDTREE_TRACE_NODE("subtree", size());
+	{
+		KDTREE_TRACE_NODE("bounds", size());
+		crop();
+	}
+	if (!m_lazy) {
+		split();
+	}
+}
+
+template <class T, class Alloc>
+Node<T, Alloc>::Node(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool,
+					 QuerySample& sample, uint64_t first, uint64_t last)
+	: m_points(points)
+	, m_begin(begin)
+	, m_end(end)
+	, m_inserted(0)
+	, m_pool(pool)
+	, m_lazy(false)
+	, m_expanded(true)
+{
+	KDTREE_TRACE_NODE("subtree", end - begin);
+	{
+		KDTREE_TRACE_NODE("bounds", end - begin);
+		box.crop(points, begin, end);
+	}
+	split(sample, first, last);
+}
+
+template <class T, class Alloc>
+Node<T, Alloc>::~Node()
+{
+	destroy(left);
+	destroy(right);
+}
+
+template <class T, class Alloc>
+Node<T, Alloc>* Node<T, Alloc>::create(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool,
+									   bool lazy, std::vector<uint64_t> overflow)
+{
+	if (pool) {
+		return new (pool->allocate()) Node<T, Alloc>(points, begin, end, pool, lazy, std::move(overflow));
+	}
+	return new Node<T, Alloc>(points, begin, end, nullptr, lazy, std::move(overflow));
+}
+
+template <class T, class Alloc>
+Node<T, Alloc>* Node<T, Alloc>::create(std::vector<T, Alloc>& points, uint64_t begin, uint64_t end, HugePagePool<Node<T, Alloc>>* pool,
+									   QuerySample& sample, uint64_t first, uint64_t last)
+{
+	if (pool) {
+		return new (pool->allocate()) Node<T, Alloc>(points, begin, end, pool, sample, first, last);
+	}
+	return new Node<T, Alloc>(points, begin, end, nullptr, sample, first, last);
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::destroy(Node<T, Alloc>* node)
+{
+	if (!node) {
+		return;
+	}
+
+	if (HugePagePool<Node<T, Alloc>>* pool = node->m_pool) {
+		node->~Node();
+		pool->deallocate(node);
+	} else {
+		delete node;
+	}
+}
+
+template <class T, class Alloc>
+bool Node<T, Alloc>::isLeaf() const
+{
+	return !left;
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::expand() const
+{
+	if (m_expanded.load(std::memory_order_acquire)) {
+		return;
+	}
+
+	// a mutex per node would make all nodes bigger, so nodes share a few
+	static std::mutex mutexes[64];
+	std::lock_guard<std::mutex> lock(mutexes[reinterpret_cast<uintptr_t>(this) / sizeof(*this) % 64]);
+	if (!m_expanded.load(std::memory_order_relaxed))
+	{
+		// only reorders the points of this node, which no query scans yet
+		KDTREE_TRACE_NODE("expand", size());
+		const_cast<Node<T, Alloc>*>(this)->split();
+		m_expanded.store(true, std::memory_order_release);
+	}
+}
+
+template <class T, class Alloc>
+uint64_t Node<T, Alloc>::size() const
 {
-	box.crop(points, begin, end);
+	return m_end - m_begin + m_inserted;
+}
+
+template <class T, class Alloc>
+uint64_t Node<T, Alloc>::inserted() const
+{
+	return m_inserted;
+}
+
+template <class T, class Alloc>
+template <class F>
+bool Node<T, Alloc>::scan(F&& f) const
+{
+	for (uint64_t i = m_begin; i < m_end; ++i)
+	{
+		if (!f(i))
+			return false;
+	}
+	for (uint64_t i : m_overflow)
+	{
+		if (!f(i))
+			return false;
+	}
+	return true;
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::crop()
+{
+	// the interval of a node may be empty if it only holds inserted points
+	if (m_begin < m_end || m_overflow.empty()) {
+		box.crop(m_points, m_begin, m_end);
+	} else {
+		box.crop(m_points, m_overflow[0], m_overflow[0] + 1);
+	}
+
+	for (uint64_t i : m_overflow)
+	{
+		const float x[3] = {pointCoordinate(m_points[i], 0), pointCoordinate(m_points[i], 1), pointCoordinate(m_points[i], 2)};
+		box.extend(x);
+	}
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::split()
+{
+	if (!m_overflow.empty())
+	{
+		if (size() > N)
+			splitOverflow();
+		return;
+	}
 
 	// split on too many points
 	if (m_end - m_begin > N)
 	{
-		const uint64_t median = begin + (end - begin) / 2;
+		const uint64_t median = m_begin + (m_end - m_begin) / 2;
 		SortAxisComparator<T> lessThan(box.getSplitAxis());
 
-		std::nth_element(points.begin() + begin,
-						 points.begin() + median,
-						 points.begin() + end, lessThan);
+		{
+			KDTREE_TRACE_NODE("partition", size());
+			std::nth_element(m_points.begin() + m_begin,
+							 m_points.begin() + median,
+							 m_points.begin() + m_end, lessThan);
+		}
 
-		left = new Node<T>(points, begin, median);
-		right = new Node<T>(points, median, end);
+		left = create(m_points, m_begin, median, m_pool, m_lazy);
+		right = create(m_points, median, m_end, m_pool, m_lazy);
 	}
 }
 
-template <class T>
-Node<T>::~Node()
+template <class T, class Alloc>
+void Node<T, Alloc>::split(QuerySample& sample, uint64_t first, uint64_t last)
 {
-	if (left)  delete left;
-	if (right) delete right;
+	// queries per point in this node, relative to the whole cloud. The +1
+	// avoids a division by zero and keeps nodes without queries finite.
+	const float ratio = (last - first + 1.0f) / (size() * sample.density + 1.0f);
+	const uint64_t leafSize = std::min(maxLeafSize, std::max(minLeafSize, static_cast<uint64_t>(N / ratio)));
+
+	if (size() > leafSize)
+	{
+		const uint64_t median = m_begin + (m_end - m_begin) / 2;
+		const int axis = box.getSplitAxis();
+		SortAxisComparator<T> lessThan(axis);
+		uint64_t middle;
+		{
+			KDTREE_TRACE_NODE("partition", size());
+			std::nth_element(m_points.begin() + m_begin,
+							 m_points.begin() + median,
+							 m_points.begin() + m_end, lessThan);
+
+			// the queries follow the points to the children
+			const float split = pointCoordinate(m_points[median], axis);
+			middle = std::partition(sample.queries.begin() + first, sample.queries.begin() + last,
+									[&](const std::array<float, 3>& q) { return q[axis] < split; })
+				   - sample.queries.begin();
+		}
+
+		left = create(m_points, m_begin, median, m_pool, sample, first, middle);
+		right = create(m_points, median, m_end, m_pool, sample, middle, last);
+	}
 }
 
-template <class T>
-bool Node<T>::isLeaf() const
+template <class T, class Alloc>
+void Node<T, Alloc>::splitOverflow()
 {
-	return !left;
+	const int axis = box.getSplitAxis();
+	const uint64_t half = size() / 2;
+	uint64_t* overflow = m_overflow.data();
+	const uint64_t count = m_overflow.size();
+	uint64_t middle;
+	uint64_t overflowMiddle;
+	{
+		KDTREE_TRACE_NODE("partition", size());
+
+		// the median coordinate of the interval and the overflow list together
+		std::vector<float> coordinates;
+		coordinates.reserve(size());
+		scan([&](uint64_t i) {
+			coordinates.push_back(pointCoordinate(m_points[i], axis));
+			return true;
+		});
+		std::nth_element(coordinates.begin(), coordinates.begin() + half, coordinates.end());
+		const float split = coordinates[half];
+
+		// points below the median go left, points above right, and points on
+		// the median fill up the left child to half of the points
+		auto below = [&](const T& p) { return pointCoordinate(p, axis) < split; };
+		auto on = [&](const T& p) { return pointCoordinate(p, axis) == split; };
+		middle = std::partition(m_points.begin() + m_begin, m_points.begin() + m_end, below) - m_points.begin();
+		const uint64_t equal = std::partition(m_points.begin() + middle, m_points.begin() + m_end, on) - m_points.begin();
+		overflowMiddle = std::partition(overflow, overflow + count, [&](uint64_t i) { return below(m_points[i]); }) - overflow;
+		std::partition(overflow + overflowMiddle, overflow + count, [&](uint64_t i) { return on(m_points[i]); });
+
+		const uint64_t missing = half - (middle - m_begin) - overflowMiddle;
+		const uint64_t fromInterval = std::min(missing, equal - middle);
+		middle += fromInterval;
+		overflowMiddle += missing - fromInterval;
+	}
+
+	left = create(m_points, m_begin, middle, m_pool, m_lazy, std::vector<uint64_t>(overflow, overflow + overflowMiddle));
+	right = create(m_points, middle, m_end, m_pool, m_lazy, std::vector<uint64_t>(overflow + overflowMiddle, overflow + count));
+	std::vector<uint64_t>().swap(m_overflow);
 }
 
-template <class T>
-void Node<T>::findKNearest(const float* p, const unsigned int k, std::vector<T>& result)
+template <class T, class Alloc>
+void Node<T, Alloc>::rebuild()
+{
+	// the inserted points of all leaves move to this node
+	std::vector<uint64_t> overflow;
+	collectOverflow(overflow);
+
+	destroy(left);
+	destroy(right);
+	left = nullptr;
+	right = nullptr;
+
+	m_overflow = std::move(overflow);
+	crop();
+	if (m_lazy) {
+		m_expanded.store(false, std::memory_order_relaxed);
+	} else {
+		split();
+	}
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::collectOverflow(std::vector<uint64_t>& overflow) const
+{
+	if (isLeaf())
+	{
+		overflow.insert(overflow.end(), m_overflow.begin(), m_overflow.end());
+		return;
+	}
+
+	left->collectOverflow(overflow);
+	right->collectOverflow(overflow);
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::compact(const std::vector<T, Alloc>& from, std::vector<T, Alloc>& to)
+{
+	const uint64_t begin = to.size();
+	if (isLeaf())
+	{
+		to.insert(to.end(), from.begin() + m_begin, from.begin() + m_end);
+		for (uint64_t i : m_overflow) {
+			to.push_back(from[i]);
+		}
+		std::vector<uint64_t>().swap(m_overflow);
+	}
+	else
+	{
+		left->compact(from, to);
+		right->compact(from, to);
+	}
+
+	m_begin = begin;
+	m_end = to.size();
+	m_inserted = 0;
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::insert(const T& item)
+{
+	// walk down to the leaf with the closest bounding box. The boxes along the
+	// path grow to contain the new point, no other point moves.
+	const float x[3] = {pointCoordinate(item, 0), pointCoordinate(item, 1), pointCoordinate(item, 2)};
+	std::vector<Node<T, Alloc>*> path;
+	Node<T, Alloc>* node = this;
+	for (;;)
+	{
+		node->box.extend(x);
+		++node->m_inserted;
+		path.push_back(node);
+
+		if (node->isLeaf())
+			break;
+
+		const float tl = node->left->box.distance2(x);
+		const float tr = node->right->box.distance2(x);
+		node = tl < tr || (tl == tr && node->left->size() <= node->right->size()) ? node->left : node->right;
+	}
+
+	node->m_overflow.push_back(m_points.size());
+	m_points.push_back(item);
+
+	// rebuild the topmost unbalanced node, this implicitly splits the leaf
+	for (Node<T, Alloc>* n : path)
+	{
+		if (n->isLeaf())
+		{
+			// a lazy node that is not expanded yet splits on the next query
+			if (n->size() > N && n->m_expanded.load(std::memory_order_relaxed))
+				n->rebuild();
+			break;
+		}
+
+		const uint64_t heavy = std::max(n->left->size(), n->right->size());
+		if (heavy > alpha * n->size())
+		{
+			n->rebuild();
+			break;
+		}
+	}
+}
+
+template <class T, class Alloc>
+double Node<T, Alloc>::refit(unsigned int parallel)
 {
+	KDTREE_TRACE_NODE("refit", size());
+	if (isLeaf())
+	{
+		crop();
+		return box.surfaceArea();
+	}
+
+	double cost;
+	if (parallel > 0)
+	{
+		std::future<double> leftCost = std::async(std::launch::async, &Node<T, Alloc>::refit, left, parallel - 1);
+		cost = right->refit(parallel - 1);
+		cost += leftCost.get();
+	}
+	else
+	{
+		cost = left->refit(0) + right->refit(0);
+	}
+
+	box = left->box;
+	box.extend(right->box);
+	return cost + box.surfaceArea();
+}
+
+template <class T, class Alloc>
+double Node<T, Alloc>::cost() const
+{
+	double c = box.surfaceArea();
+	if (!isLeaf())
+	{
+		c += left->cost() + right->cost();
+	}
+	return c;
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::findKNearest(const float* p, const unsigned int k, std::vector<T>& result,
+								  std::vector<float>& distances, float& bound) const
+{
+	expand();
+
 	if (!isLeaf())
 	{
 		float tl = left->box.distance2(p);
 		float tr = right->box.distance2(p);
-		if (tl < dist && tl < tr)
+		if (tl < bound && tl < tr)
+		{
+			left->findKNearest(p, k, result, distances, bound);
+			if (tr < bound) right->findKNearest(p, k, result, distances, bound);
+		}
+		else if (tr < bound)
+		{
+			right->findKNearest(p, k, result, distances, bound);
+			if (tl < bound) left->findKNearest(p, k, result, distances, bound);
+		}
+	}
+	else
+	{
+		KDTREE_COUNT_LEAF(size());
+		scan([&](uint64_t i) {
+			const float d = pointDistance2(m_points[i], p);
+			if (d < bound)
+			{
+				bound = insertNearest(result, distances, k, m_points[i], d);
+			}
+			return true;
+		});
+	}
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::findInRadius(const float* m, const float radius2, std::vector<T>& result,
+								  std::vector<float>& distances) const
+{
+	expand();
+
+	if (!isLeaf())
+	{
+		if (left->box.distance2(m) <= radius2)
 		{
-			left->findKNearest(p, k, result);
-			if (tr < dist) right->findKNearest(p, k, result);
+			left->findInRadius(m, radius2, result, distances);
 		}
-		else if (tr < dist)
+		if (right->box.distance2(m) <= radius2)
 		{
-			right->findKNearest(p, k, result);
-			if (tl < dist) left->findKNearest(p, k, result);
+			right->findInRadius(m, radius2, result, distances);
 		}
 	}
 	else
 	{
-		for (uint64_t i = m_begin; i < m_end; ++i)
+		// it is a leaf
+		KDTREE_COUNT_LEAF(size());
+		scan([&](uint64_t i) {
+			const float d = pointDistance2(m_points[i], m);
+			if (d <= radius2)
+			{
+				result.push_back(m_points[i]);
+				setDistance(result.back(), d);
+				distances.push_back(d);
+			}
+			return true;
+		});
+	}
+}
+
+inline void QueryPacket::set(const float* queries, uint64_t first, uint64_t count)
+{
+	this->count = static_cast<unsigned int>(std::min<uint64_t>(size, count - first));
+
+	for (unsigned int j = 0; j < size; ++j)
+	{
+		const float* m = queries + 3 * (first + (j < this->count ? j : 0));
+		x[j] = m[0];
+		y[j] = m[1];
+		z[j] = m[2];
+		index[j] = first + j;
+
+		for (int i = 0; i < 3; ++i)
 		{
-			if (m_points[i].distance2(p) < dist)
+			p[i] = j ? std::min(p[i], m[i]) : m[i];
+			q[i] = j ? std::max(q[i], m[i]) : m[i];
+		}
+	}
+}
+
+template <class T, class Alloc>
+void Node<T, Alloc>::findInRadius(const QueryPacket& packet, uint32_t active, const float radius2,
+								  std::vector<std::vector<T>>& results, std::vector<std::vector<float>>& distances) const
+{
+	expand();
+
+	if (!isLeaf())
+	{
+		// split the packet only where the children diverge
+		for (const Node<T, Alloc>* child : {left, right})
+		{
+			const BoundingBox<T>& b = child->box;
+
+			// distance between the box of the packet and the child's box
+			float d = 0.0f;
+			bool inside = true;
+			for (int i = 0; i < 3; ++i)
 			{
-				// add point
-				if (result.size() < k-1)
-				{
-					result.push_back(m_points[i]);
-				}
-				else if (result.size() < k)
-				{
-					// happens exactly once
-					// it is the last point that is found unsorted. Therefore, sort once.
-					result.push_back(m_points[i]);
-					std::sort(result.begin(), result.end(), T::smaller_dist);
-					dist = result.back().dist;
-				}
-				else
+				const float below = b.p[i] - packet.q[i];
+				const float above = packet.p[i] - b.q[i];
+				if (below > 0.0f) d += below * below;
+				else if (above > 0.0f) d += above * above;
+				inside = inside && b.p[i] <= packet.p[i] && packet.q[i] <= b.q[i];
+			}
+
+			if (d > radius2)
+				continue;
+
+			// all queries in the child's box keep overlapping it
+			uint32_t childActive = active;
+			if (!inside)
+			{
+				for (uint32_t lanes = active; lanes; lanes &= lanes - 1)
 				{
-					// size == k, insert sorted, and remove last
-					result.insert(
-						std::upper_bound(result.begin(),
-										 result.end(),
-										 m_points[i],
-										 T::smaller_dist),
-						m_points[i]);
-
-					// remove last point
-					result.pop_back();
-					dist = result.back().dist;
+					const unsigned int j = std::countr_zero(lanes);
+					const float m[3] = {packet.x[j], packet.y[j], packet.z[j]};
+					if (b.distance2(m) > radius2)
+						childActive &= ~(1u << j);
 				}
 			}
+
+			if (childActive)
+				child->findInRadius(packet, childActive, radius2, results, distances);
 		}
+		return;
 	}
+
+	// it is a leaf, process a tile of points x queries
+	float d[QueryPacket::size];
+	scan([&](uint64_t i) {
+		const float p[3] = {
+			pointCoordinate(m_points[i], 0),
+			pointCoordinate(m_points[i], 1),
+			pointCoordinate(m_points[i], 2)
+		};
+		for (unsigned int j = 0; j < QueryPacket::size; ++j)
+		{
+			d[j] = (packet.x[j] - p[0]) * (packet.x[j] - p[0])
+				 + (packet.y[j] - p[1]) * (packet.y[j] - p[1])
+				 + (packet.z[j] - p[2]) * (packet.z[j] - p[2]);
+		}
+
+		for (uint32_t lanes = active; lanes; lanes &= lanes - 1)
+		{
+			const unsigned int j = std::countr_zero(lanes);
+			if (d[j] <= radius2)
+			{
+				results[packet.index[j]].push_back(m_points[i]);
+				setDistance(results[packet.index[j]].back(), d[j]);
+				distances[packet.index[j]].push_back(d[j]);
+			}
+		}
+		return true;
+	});
 }
 
-template <class T>
-void Node<T>::findInRadius(const float* m, const float radius2, std::vector<T>& result)
+template <class T, class Alloc>
+void Node<T, Alloc>::findNearest(const QueryPacket& packet, uint32_t active, float* best2, uint64_t* nearest) const
 {
+	expand();
+
 	if (!isLeaf())
 	{
-		if (left->box.distance2(m) <= radius2)
+		// descend into the child closer to the center of the packet first
+		const float center[3] = {
+			0.5f * (packet.p[0] + packet.q[0]),
+			0.5f * (packet.p[1] + packet.q[1]),
+			0.5f * (packet.p[2] + packet.q[2])
+		};
+		const Node<T, Alloc>* first = left;
+		const Node<T, Alloc>* second = right;
+		if (right->box.distance2(center) < left->box.distance2(center))
+			std::swap(first, second);
+
+		for (const Node<T, Alloc>* child : {first, second})
 		{
-			left->findInRadius(m, radius2, result);
+			// the bounds shrink while the first child is processed
+			const uint32_t childActive = active & child->closerLanes(packet, best2);
+			if (childActive)
+				child->findNearest(packet, childActive, best2, nearest);
 		}
-		if (right->box.distance2(m) <= radius2)
+		return;
+	}
+
+	// it is a leaf, process a tile of points x queries. Inactive lanes are
+	// updated as well, any closer point is a valid improvement for them.
+	// The lanes track the scan position of their nearest point, 32 bit
+	// integers that select with bit masks, so the loop vectorizes.
+	int32_t closest[QueryPacket::size];
+	std::fill(closest, closest + QueryPacket::size, -1);
+	int32_t position = 0;
+	scan([&](uint64_t i) {
+		const float p[3] = {
+			pointCoordinate(m_points[i], 0),
+			pointCoordinate(m_points[i], 1),
+			pointCoordinate(m_points[i], 2)
+		};
+		for (unsigned int j = 0; j < QueryPacket::size; ++j)
 		{
-			right->findInRadius(m, radius2, result);
+			const float d = (packet.x[j] - p[0]) * (packet.x[j] - p[0])
+						  + (packet.y[j] - p[1]) * (packet.y[j] - p[1])
+						  + (packet.z[j] - p[2]) * (packet.z[j] - p[2]);
+			const int32_t closer = -static_cast<int32_t>(d < best2[j]);
+			best2[j] = std::min(d, best2[j]);
+			closest[j] = (position & closer) | (closest[j] & ~closer);
 		}
+		++position;
+		return true;
+	});
+
+	// scan() visits the interval first, then the inserted points
+	const int32_t interval = static_cast<int32_t>(m_end - m_begin);
+	for (unsigned int j = 0; j < QueryPacket::size; ++j)
+	{
+		if (closest[j] >= 0)
+			nearest[j] = closest[j] < interval ? m_begin + closest[j] : m_overflow[closest[j] - interval];
 	}
-	else
+}
+
+template <class T, class Alloc>
+uint32_t Node<T, Alloc>::closerLanes(const QueryPacket& packet, const float* bound2) const
+{
+	// max(x, 0) as (x + |x|) / 2 without a branch, the result is exact
+	auto positive = [](float x) { return 0.5f * (x + std::fabs(x)); };
 
-	// it is a leaf
-	for (unsigned int i = m_begin; i < m_end; ++i)
+	float d[QueryPacket::size];
+	for (unsigned int j = 0; j < QueryPacket::size; ++j)
 	{
-		if (m_points[i].distance2(m) <= radius2)
-			result.push_back(m_points[i]);
+		const float t0 = positive(box.p[0] - packet.x[j]) + positive(packet.x[j] - box.q[0]);
+		const float t1 = positive(box.p[1] - packet.y[j]) + positive(packet.y[j] - box.q[1]);
+		const float t2 = positive(box.p[2] - packet.z[j]) + positive(packet.z[j] - box.q[2]);
+		d[j] = t0 * t0 + t1 * t1 + t2 * t2;
 	}
+
+	uint32_t lanes = 0;
+	for (unsigned int j = 0; j < QueryPacket::size; ++j) {
+		lanes |= static_cast<uint32_t>(d[j] < bound2[j]) << j;
+	}
+	return lanes;
+}
+
+template <class T, class Alloc>
+template <class Visitor>
+bool Node<T, Alloc>::visitInRadius(const float* m, const float radius2, Visitor&& visitor) const
+{
+	expand();
+
+	if (!isLeaf())
+	{
+		if (left->box.distance2(m) <= radius2 && !left->visitInRadius(m, radius2, visitor))
+		{
+			return false;
+		}
+		if (right->box.distance2(m) <= radius2 && !right->visitInRadius(m, radius2, visitor))
+		{
+			return false;
+		}
+		return true;
+	}
+
+	return scan([&](uint64_t i) {
+		const float d = pointDistance2(m_points[i], m);
+		return d > radius2 || visitor(i, d);
+	});
 }
 
 }
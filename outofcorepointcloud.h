@@ -0,0 +1,395 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_OUTOFCOREPOINTCLOUD_H
+#define KDTREE_OUTOFCOREPOINTCLOUD_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <utility> // std::pair
+#include <cstdint> // uint32_t, uint64_t
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flattree.h"
+#include "blockreader.h"
+#include "neighbors.h"
+
+namespace kdtree
+{
+
+/**
+ * The class @p OutOfCorePointCloud queries a kdtree file written by
+ * saveFlatTree() without loading the points into memory.
+ *
+ * Only the nodes are kept in memory. Queries are processed in batches: first,
+ * the in-memory tree is traversed for all queries to find the leaves they
+ * need. The point blocks of these leaves are then read asynchronously, each
+ * leaf once per batch (see @p BlockReader), and every leaf is scanned for all
+ * its queries as soon as its block arrives.
+ */
+template <class T>
+class OutOfCorePointCloud
+{
+#ifdef __cpp_concepts
+	static_assert(SpatialPoint<T>, "T needs coordinates, see PointTraits");
+#endif
+
+public:
+	OutOfCorePointCloud() = default;
+	OutOfCorePointCloud(const OutOfCorePointCloud&) = delete;
+	OutOfCorePointCloud& operator=(const OutOfCorePointCloud&) = delete;
+	~OutOfCorePointCloud();
+
+	/**
+	 * Open the file @p fileName and load its nodes.
+	 * @return true on success, false if the file cannot be read or is invalid.
+	 */
+	bool open(const std::string& fileName);
+
+	/**
+	 * Close the file.
+	 */
+	void close();
+
+	/**
+	 * Find the @p k nearest points for each of the @p count reference points
+	 * @p queries (3 floats each). The points are found in two rounds: the
+	 * leaves closest to each query yield an upper bound for the k-th distance,
+	 * then all remaining leaves within that bound are read.
+	 * @param results returned vectors with the points of each query, sorted by distance
+	 * @return true on success, false if no file is open or reading failed.
+	 */
+	bool findKNearest(const float* queries, uint64_t count, unsigned int k, std::vector<std::vector<T>>& results);
+
+	/**
+	 * Like findKNearest(), but also returns the square distances of the points
+	 * of each query in the parallel vectors @p distances.
+	 */
+	bool findKNearest(const float* queries, uint64_t count, unsigned int k, std::vector<std::vector<T>>& results,
+					  std::vector<std::vector<float>>& distances);
+
+	/**
+	 * Find all points in the spheres with square radius @p radius2 around each
+	 * of the @p count centers @p queries (3 floats each).
+	 * @param results returned vectors with the points of each query
+	 * @return true on success, false if no file is open or reading failed.
+	 */
+	bool findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results);
+
+	/**
+	 * Like findInRadius(), but also returns the square distances of the points
+	 * of each query in the parallel vectors @p distances.
+	 */
+	bool findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results,
+					  std::vector<std::vector<float>>& distances);
+
+private:
+	/// a leaf needed by a query
+	using LeafRequest = std::pair<uint32_t, uint64_t>;
+
+	/// uninitialized storage for a point, T has no default constructor
+	struct alignas(T) PointStorage
+	{
+		unsigned char bytes[sizeof(T)];
+	};
+
+	/**
+	 * Append requests for all leaves with a box distance to @p m less than
+	 * @p radius2 (or equal, if @p inclusive is true).
+	 */
+	void collectLeaves(uint32_t node, const float* m, float radius2, bool inclusive,
+					   uint64_t query, std::vector<LeafRequest>& requests) const;
+
+	/**
+	 * Read the leaves of all @p requests and call @p scan(query, points, n)
+	 * for every request as soon as the points of its leaf are available.
+	 */
+	template <class Scan>
+	bool readLeaves(std::vector<LeafRequest>& requests, Scan scan);
+
+	int m_fd = -1;
+	FlatTreeHeader m_header = {};
+	std::vector<FlatNode> m_nodes;
+	std::unique_ptr<BlockReader> m_reader;
+};
+
+
+//
+//
+// TEMPLATE IMPLEMENTATION
+//
+//
+
+template <class T>
+OutOfCorePointCloud<T>::~OutOfCorePointCloud()
+{
+	close();
+}
+
+template <class T>
+bool OutOfCorePointCloud<T>::open(const std::string& fileName)
+{
+	close();
+
+	m_fd = ::open(fileName.c_str(), O_RDONLY);
+	if (m_fd < 0) {
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(m_fd, &info) != 0
+		|| pread(m_fd, &m_header, sizeof(m_header), 0) != static_cast<ssize_t>(sizeof(m_header))
+		|| !validFlatTreeHeader(m_header, info.st_size, sizeof(T), alignof(T))) {
+		close();
+		return false;
+	}
+
+	m_nodes.resize(m_header.numNodes);
+	const ssize_t nodeBytes = m_header.numNodes * sizeof(FlatNode);
+	if (pread(m_fd, m_nodes.data(), nodeBytes, m_header.nodesOffset) != nodeBytes
+		|| !validFlatTreeNodes(m_nodes.data(), m_header.numNodes, m_header.numPoints)) {
+		close();
+		return false;
+	}
+
+	m_reader = BlockReader::create(m_fd);
+	return true;
+}
+
+template <class T>
+void OutOfCorePointCloud<T>::close()
+{
+	// the reader must not use the file descriptor anymore
+	m_reader.reset();
+
+	if (m_fd >= 0) {
+		::close(m_fd);
+	}
+
+	m_fd = -1;
+	m_header = FlatTreeHeader();
+	m_nodes.clear();
+}
+
+template <class T>
+void OutOfCorePointCloud<T>::collectLeaves(uint32_t node, const float* m, float radius2, bool inclusive,
+										   uint64_t query, std::vector<LeafRequest>& requests) const
+{
+	const FlatNode& n = m_nodes[node];
+	if (!n.right)
+	{
+		requests.emplace_back(node, query);
+		return;
+	}
+
+	for (const uint32_t child : {node + 1, n.right})
+	{
+		const float d = m_nodes[child].box.distance2(m);
+		if (d < radius2 || (inclusive && d == radius2)) {
+			collectLeaves(child, m, radius2, inclusive, query, requests);
+		}
+	}
+}
+
+template <class T>
+template <class Scan>
+bool OutOfCorePointCloud<T>::readLeaves(std::vector<LeafRequest>& requests, Scan scan)
+{
+	// all queries of one leaf are processed together
+	std::sort(requests.begin(), requests.end());
+
+	// first request of each distinct leaf
+	std::vector<uint64_t> leaves;
+	for (uint64_t i = 0; i < requests.size(); ++i) {
+		if (i == 0 || requests[i].first != requests[i - 1].first) {
+			leaves.push_back(i);
+		}
+	}
+	leaves.push_back(requests.size());
+
+	const uint64_t numLeaves = leaves.size() - 1;
+	const uint64_t depth = std::min<uint64_t>(m_reader->queueDepth(), numLeaves);
+	std::vector<std::vector<PointStorage>> buffers(depth);
+	std::vector<uint64_t> bufferLeaf(depth);
+
+	const auto submit = [&](uint64_t slot, uint64_t leaf) {
+		const FlatNode& node = m_nodes[requests[leaves[leaf]].first];
+		buffers[slot].resize(node.end - node.begin);
+		bufferLeaf[slot] = leaf;
+		m_reader->submit(slot, m_header.pointsOffset + node.begin * sizeof(T),
+						 (node.end - node.begin) * sizeof(T), buffers[slot].data());
+	};
+
+	uint64_t next = 0;
+	for (; next < depth; ++next) {
+		submit(next, next);
+	}
+
+	bool success = true;
+	for (uint64_t done = 0; done < numLeaves; ++done)
+	{
+		uint64_t slot;
+		if (!m_reader->wait(slot)) {
+			success = false;
+		}
+
+		const uint64_t leaf = bufferLeaf[slot];
+		if (success) {
+			for (uint64_t i = leaves[leaf]; i < leaves[leaf + 1]; ++i) {
+				scan(requests[i].second, reinterpret_cast<const T*>(buffers[slot].data()), buffers[slot].size());
+			}
+		}
+
+		// keep the queue filled
+		if (next < numLeaves) {
+			submit(slot, next++);
+		}
+	}
+
+	return success;
+}
+
+template <class T>
+bool OutOfCorePointCloud<T>::findKNearest(const float* queries, uint64_t count, unsigned int k, std::vector<std::vector<T>>& results)
+{
+	std::vector<std::vector<float>> distances;
+	return findKNearest(queries, count, k, results, distances);
+}
+
+template <class T>
+bool OutOfCorePointCloud<T>::findKNearest(const float* queries, uint64_t count, unsigned int k, std::vector<std::vector<T>>& results,
+										  std::vector<std::vector<float>>& distances)
+{
+	results.assign(count, std::vector<T>());
+	distances.assign(count, std::vector<float>());
+
+	if (m_fd < 0) {
+		return false;
+	}
+
+	if (k == 0 || m_nodes.empty()) {
+		return true;
+	}
+
+	std::vector<float> bound(count, std::numeric_limits<float>::max());
+
+	const auto scan = [&](uint64_t q, const T* points, uint64_t n) {
+		for (uint64_t i = 0; i < n; ++i)
+		{
+			const float d = pointDistance2(points[i], queries + 3 * q);
+			if (d < bound[q])
+			{
+				bound[q] = insertNearest(results[q], distances[q], k, points[i], d);
+			}
+		}
+	};
+
+	// round 1: the closest leaves of each query with at least k points in total
+	std::vector<LeafRequest> requests;
+	for (uint64_t q = 0; q < count; ++q)
+	{
+		using Candidate = std::pair<float, uint32_t>;
+		std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+		candidates.emplace(m_nodes[0].box.distance2(queries + 3 * q), 0);
+
+		uint64_t found = 0;
+		while (!candidates.empty() && found < k)
+		{
+			const uint32_t node = candidates.top().second;
+			candidates.pop();
+
+			const FlatNode& n = m_nodes[node];
+			if (n.right) {
+				candidates.emplace(m_nodes[node + 1].box.distance2(queries + 3 * q), node + 1);
+				candidates.emplace(m_nodes[n.right].box.distance2(queries + 3 * q), n.right);
+			} else {
+				requests.emplace_back(node, q);
+				found += n.end - n.begin;
+			}
+		}
+	}
+
+	std::vector<LeafRequest> scanned(requests);
+	if (!readLeaves(requests, scan)) {
+		return false;
+	}
+
+	// round 2: all other leaves closer than the current k-th distance
+	requests.clear();
+	for (uint64_t q = 0; q < count; ++q) {
+		collectLeaves(0, queries + 3 * q, bound[q], false, q, requests);
+	}
+
+	std::sort(scanned.begin(), scanned.end());
+	requests.erase(std::remove_if(requests.begin(), requests.end(), [&scanned](const LeafRequest& request) {
+					   return std::binary_search(scanned.begin(), scanned.end(), request);
+				   }), requests.end());
+
+	if (!readLeaves(requests, scan)) {
+		return false;
+	}
+
+	// less than k points in the file
+	for (uint64_t q = 0; q < count; ++q) {
+		if (results[q].size() < k) {
+			sortNearest(results[q], distances[q]);
+		}
+	}
+
+	return true;
+}
+
+template <class T>
+bool OutOfCorePointCloud<T>::findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results)
+{
+	std::vector<std::vector<float>> distances;
+	return findInRadius(queries, count, radius2, results, distances);
+}
+
+template <class T>
+bool OutOfCorePointCloud<T>::findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results,
+										  std::vector<std::vector<float>>& distances)
+{
+	results.assign(count, std::vector<T>());
+	distances.assign(count, std::vector<float>());
+
+	if (m_fd < 0) {
+		return false;
+	}
+
+	if (m_nodes.empty()) {
+		return true;
+	}
+
+	std::vector<LeafRequest> requests;
+	for (uint64_t q = 0; q < count; ++q) {
+		if (m_nodes[0].box.distance2(queries + 3 * q) <= radius2) {
+			collectLeaves(0, queries + 3 * q, radius2, true, q, requests);
+		}
+	}
+
+	return readLeaves(requests, [&](uint64_t q, const T* points, uint64_t n) {
+		for (uint64_t i = 0; i < n; ++i) {
+			const float d = pointDistance2(points[i], queries + 3 * q);
+			if (d <= radius2) {
+				results[q].push_back(points[i]);
+				setDistance(results[q].back(), d);
+				distances[q].push_back(d);
+			}
+		}
+	});
+}
+
+}
+
+#endif // KDTREE_OUTOFCOREPOINTCLOUD_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
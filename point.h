@@ -9,32 +9,64 @@ namespace kdtree
 {
 
 /**
- * The class @p Point represents a point in 3D space.
+ * The class @p SlimPoint represents a point in 3D space by its coordinates
+ * only. Distances of query results are returned separately, see
+ * PointCloud::findKNearest(), so a stored point takes 12 bytes.
  */
-class Point
+class SlimPoint
 {
 public:
-	constexpr Point(float x, float y, float z) noexcept
+	constexpr SlimPoint(float x, float y, float z) noexcept
 		: p{x, y, z}
-		, dist(0)
 	{
 	}
 
 	/**
 	 * Square distance.
 	 */
-	float distance2(const float* x)
+	float distance2(const float* x) const
 	{
 		// avoid loop
-		dist = (x[0] - p[0]) * (x[0] - p[0]) + (x[1] - p[1]) * (x[1] - p[1]) + (x[2] - p[2]) * (x[2] - p[2]);
-		return dist;
+		return (x[0] - p[0]) * (x[0] - p[0]) + (x[1] - p[1]) * (x[1] - p[1]) + (x[2] - p[2]) * (x[2] - p[2]);
 	}
 
 	float p[3]; ///< point coordinates
-	float dist; ///< (cached) distance from point to another
+};
+
+/**
+ * The class @p PayloadPoint is a @p SlimPoint with user data @p payload,
+ * e.g. an intensity or the index of the point in another buffer.
+ */
+template <class Payload>
+class PayloadPoint : public SlimPoint
+{
+public:
+	constexpr PayloadPoint(float x, float y, float z, const Payload& data = Payload())
+		: SlimPoint(x, y, z)
+		, payload(data)
+	{
+	}
+
+	Payload payload; ///< user data
+};
+
+/**
+ * The class @p Point represents a point in 3D space. In addition to the
+ * coordinates, query results carry their square distance in @p dist.
+ */
+class Point : public SlimPoint
+{
+public:
+	constexpr Point(float x, float y, float z) noexcept
+		: SlimPoint(x, y, z)
+		, dist(0)
+	{
+	}
+
+	float dist; ///< square distance to the reference point, set in query results only
 	
 	/**
-	 * define comparison for 2-Norm^2. This uses the cached dist values!
+	 * define comparison for 2-Norm^2. This uses the dist values of query results!
 	 */
 	static inline bool smaller_dist(const Point& x, const Point& y)
 	{
@@ -14,20 +14,41 @@ SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
 
 #include "point.h"
 #include "node.h"
+#include "flattree.h"
+#include "querylog.h"
+#include "latency.h"
+#include "trace.h"
 
 #include <algorithm>
+#include <memory>
+#include <limits>
+#include <thread> // std::thread::hardware_concurrency
 
 namespace kdtree
 {
 
 /**
  * The class @p PointCloud represents a cloud of point data.
+ *
+ * The points are stored in a std::vector with the allocator @p Alloc. This
+ * way, the point storage can be placed in shared memory segments, NUMA local
+ * arenas, memory pools or huge pages (see @p HugePageAllocator).
  */
-template <class T>
+template <class T, class Alloc = std::allocator<T>>
 class PointCloud
 {
+#ifdef __cpp_concepts
+	static_assert(SpatialPoint<T>, "T needs coordinates, see PointTraits");
+#endif
+
 public:
 	constexpr PointCloud() = default;
+
+	/**
+	 * Constructor that uses the allocator @p alloc for the point storage.
+	 */
+	explicit PointCloud(const Alloc& alloc);
+
 	virtual ~PointCloud();
 
 	/**
@@ -38,7 +59,19 @@ public:
 	 * @param result returned vector containing the points
 	 * @return true on success, false if you forgot to call rebuildTree().
 	 */
-	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result);
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result) const;
+
+	/**
+	 * Find the @p k nearest points to given reference point @p p. The result
+	 * will be stored in the vector @p result, sorted by distance, and the
+	 * square distances in the parallel vector @p distances.
+	 * @param p reference point
+	 * @param k amount of points to find
+	 * @param result returned vector containing the points
+	 * @param distances returned square distances of the points in @p result
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const;
 
 	/**
 	 * Find all points in the sphere with center @p m and @p radius. The result
@@ -48,7 +81,105 @@ public:
 	 * @param result returned vector containing the points
 	 * @return true on success, false if you forgot to call rebuildTree().
 	 */
-	bool findInRadius(const float* m, float radius2, std::vector<T>& result);
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result) const;
+
+	/**
+	 * Find all points in the sphere with center @p m and @p radius. The result
+	 * will be stored in the vector @p result, and the square distances in the
+	 * parallel vector @p distances.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @param result returned vector containing the points
+	 * @param distances returned square distances of the points in @p result
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Visit all points in the sphere with center @p m and @p radius without
+	 * collecting them. The @p visitor is called for each point as soon as its
+	 * leaf is scanned, and may stop the search early by returning false.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @param visitor callable as bool visitor(uint64_t index, float distance2),
+	 *        where index refers to points(). Return true to continue.
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	template <class Visitor>
+	bool visitInRadius(const float* m, float radius2, Visitor&& visitor) const;
+
+	/**
+	 * Find all points in the spheres with @p radius around each of the
+	 * @p count centers @p queries (3 floats each). Consecutive queries are
+	 * grouped into packets of QueryPacket::size queries that traverse the
+	 * tree together, so pass spatially coherent queries next to each other.
+	 * @param queries the centers of the spheres
+	 * @param count amount of queries
+	 * @param radius2 square radius of the spheres
+	 * @param results returned vectors with the points of each query
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results) const;
+
+	/**
+	 * Batch findInRadius() that also returns the square distances of the
+	 * points of each query in the parallel vectors @p distances.
+	 */
+	bool findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results,
+					  std::vector<std::vector<float>>& distances) const;
+
+	/**
+	 * Find the nearest point for each of the @p count reference points
+	 * @p queries (3 floats each), e.g. the correspondences of an ICP step.
+	 * Like the batch findInRadius(), consecutive queries traverse the tree
+	 * together as a packet, each with its own nearest distance. This pays off
+	 * for spatially coherent queries, e.g. the points of a scan in scan order.
+	 * Packets whose queries spread over more than a few leaves are searched
+	 * one query at a time, like findKNearest() with k = 1.
+	 * @param queries reference points
+	 * @param count amount of queries
+	 * @param result returned vector with the nearest point of each query,
+	 *        empty if the point cloud has no points
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool findNearest(const float* queries, uint64_t count, std::vector<T>& result) const;
+
+	/**
+	 * Batch findNearest() that also returns the square distance of the
+	 * nearest point of each query in the parallel vector @p distances.
+	 */
+	bool findNearest(const float* queries, uint64_t count, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Check whether any point lies in the sphere with center @p m and @p radius.
+	 * The search stops at the first point found.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @return true if a point was found, false if not or if you forgot to call rebuildTree().
+	 */
+	bool anyWithinRadius(const float* m, float radius2) const;
+
+	/**
+	 * Find any point in the sphere with center @p m and @p radius. The search
+	 * stops at the first point found, which is not necessarily the nearest one.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @param index returned index of the point in points()
+	 * @return true if a point was found, false if not or if you forgot to call rebuildTree().
+	 */
+	bool firstWithinRadius(const float* m, float radius2, uint64_t& index) const;
+
+	/**
+	 * Check for each of the @p count spheres with centers @p queries (3 floats
+	 * each) and @p radius whether any point lies in it. For spatially coherent
+	 * queries, e.g. samples along a robot body, the point found for the previous
+	 * query is tested first, which mostly avoids a traversal. Unlike the other
+	 * batch queries, the queries do not traverse the tree as packets, which
+	 * is slower here, see the benchmark.
+	 * @param hits returned flags, true if a point lies in the respective sphere
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool anyWithinRadius(const float* queries, uint64_t count, float radius2, std::vector<bool>& hits) const;
 
 	/**
 	 * Create the KdTree structure of the current point cloud data.
@@ -57,6 +188,35 @@ public:
 	 */
 	void rebuildTree();
 
+	/**
+	 * Create the KdTree structure optimized for queries distributed like the
+	 * @p count sample queries @p querySample (3 floats each), e.g. recorded
+	 * queries of production. Leaves get smaller where the queries are denser
+	 * than the points, and bigger where there are few queries, which speeds
+	 * up queries of that distribution and saves nodes elsewhere. This build
+	 * is never lazy, and nodes rebuilt by insertItem() use the default size.
+	 * @note Without queries, this is the same as rebuildTree().
+	 */
+	void rebuildTree(const float* querySample, uint64_t count);
+
+	/**
+	 * Update the kdtree after the points were moved in place, see pointData().
+	 * Contrary to rebuildTree(), the tree structure and the order of the
+	 * points stay unchanged, only the bounding boxes are recomputed bottom-up
+	 * in parallel. This is much cheaper, but the tree degrades if the points
+	 * move a lot relative to each other.
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool refit();
+
+	/**
+	 * refit() that also returns the @p degradation of the tree: the cost of
+	 * the refitted tree relative to its cost after the last rebuildTree() or
+	 * insertItem(), both normalized by the size of the cloud. 1 means the tree is as good as
+	 * after the rebuild, beyond about 1.5 a rebuildTree() is worth it.
+	 */
+	bool refit(float& degradation);
+
 	/**
 	 * Clear all items, the PointCloud does not contain any data afterwards.
 	 */
@@ -66,13 +226,22 @@ public:
 	 * Set all data points. Before the new data is set, the old data is removed.
 	 * @note Call rebuildTree() afterwards.
 	 */
-	void setItems(const std::vector <T>& items);
+	template <class ItemAlloc>
+	void setItems(const std::vector <T, ItemAlloc>& items);
+
+	/**
+	 * Take over the storage of @p items without copying the points. Before the
+	 * new data is set, the old data is removed.
+	 * @note Call rebuildTree() afterwards.
+	 */
+	void setItems(std::vector <T, Alloc>&& items);
 
 	/**
 	 * Append data points to the already existing point cloud.
 	 * @note Call rebuildTree() afterwards.
 	 */
-	void addItems(const std::vector <T>& items);
+	template <class ItemAlloc>
+	void addItems(const std::vector <T, ItemAlloc>& items);
 
 	/**
 	 * Append a signel item to the already point cloud.
@@ -80,14 +249,114 @@ public:
 	 */
 	void addItem(const T& item);
 
+	/**
+	 * Insert a single item into the point cloud. Contrary to addItem(), an
+	 * existing kdtree stays valid: the item is appended to points() and
+	 * indexed by the leaf it is sorted into, and subtrees that get too
+	 * unbalanced are rebuilt locally. No other point moves, which makes it
+	 * suitable for continuous streaming insertions. Once the cloud doubled
+	 * since the last compaction, compact() runs automatically, so an
+	 * insertion costs O(log n) amortized.
+	 * @note Without a kdtree, this is the same as addItem().
+	 */
+	void insertItem(const T& item);
+
+	/**
+	 * Reorder points() such that the points of each leaf, including those
+	 * inserted with insertItem(), are stored next to each other again. The
+	 * tree structure stays the same. This speeds up queries after many
+	 * insertions, and flatten() needs it.
+	 */
+	void compact();
+
 	/**
 	 * Get the list of all points as const reference.
 	 */
-	const std::vector <T>& points() const;
+	const std::vector <T, Alloc>& points() const;
+
+	/**
+	 * Get the points for modification in place, e.g. to move them each frame
+	 * of a simulation. The order is the same as in points(). The kdtree keeps
+	 * referring to the old coordinates until you call refit() or rebuildTree().
+	 */
+	T* pointData();
+
+	/**
+	 * Export the kdtree as pointer free nodes in pre-order, see @p FlatNode.
+	 * The nodes refer to the order of points().
+	 * @return true on success, false if you forgot to call rebuildTree(), or
+	 *         if points were inserted since the last compact().
+	 */
+	bool flatten(std::vector<FlatNode>& nodes) const;
+
+	/**
+	 * Back the kdtree nodes and the point storage with 2 MB huge pages, which
+	 * reduces TLB misses for large clouds. Explicit huge pages (MAP_HUGETLB)
+	 * are used for the nodes if reserved by the system, otherwise transparent
+	 * huge pages are requested. Without huge page support, this is a no-op.
+	 * @note Takes effect with the next call of rebuildTree().
+	 */
+	void setHugePages(bool enable);
+
+	/**
+	 * Returns true if huge pages are enabled, see setHugePages().
+	 */
+	bool hugePages() const;
+
+	/**
+	 * Build the kdtree lazily: rebuildTree() only creates the root, and each
+	 * node is split when a query first descends into it. For a few queries in
+	 * a small region of a huge cloud, most of the tree is never built. The
+	 * first queries are slower, and queries from several threads at once are
+	 * safe, also together with setHugePages(). Since splitting reorders the
+	 * points, points() and the indices passed to visitors may change until
+	 * all queried nodes are split. refit() reports no degradation for lazy
+	 * trees.
+	 * @note Takes effect with the next call of rebuildTree().
+	 */
+	void setLazyBuild(bool enable);
+
+	/**
+	 * Returns true if the kdtree is built lazily, see setLazyBuild().
+	 */
+	bool lazyBuild() const;
+
+	/**
+	 * Record the parameters of all findKNearest() and findInRadius() queries,
+	 * including batches, to @p recorder, e.g. to replay production queries
+	 * later. The batch findNearest() is recorded as findKNearest() with
+	 * k = 1. Pass nullptr to stop recording. The recorder must outlive the
+	 * recording.
+	 */
+	void setQueryRecorder(QueryRecorder* recorder);
+
+	/**
+	 * Returns the recorder set with setQueryRecorder(), or nullptr.
+	 */
+	QueryRecorder* queryRecorder() const;
 
 private:
-	std::vector <T> m_points;
-	kdtree::Node<T>* m_kdtree = nullptr;
+	static void flatten(const Node<T, Alloc>* node, std::vector<FlatNode>& nodes);
+
+	/**
+	 * Returns the cost of the kdtree, normalized by the surface area of the
+	 * root box such that it does not depend on the extent of the cloud.
+	 */
+	double relativeCost(double cost) const;
+
+	/// the batch findNearest() searches the queries of a packet one at a time
+	/// if they start in more leaves than this
+	static constexpr unsigned int maxPacketLeaves = 4;
+
+	std::vector <T, Alloc> m_points;
+	kdtree::Node<T, Alloc>* m_kdtree = nullptr;
+	double m_buildCost = 0.0;	///< relativeCost() after rebuildTree()
+	bool m_buildCostStale = false;	///< insertItem() changed the tree since m_buildCost
+
+	bool m_hugePages = false;
+	bool m_lazyBuild = false;
+	QueryRecorder* m_recorder = nullptr;
+	std::unique_ptr<HugePagePool<Node<T, Alloc>>> m_nodePool;
 };
 
 
@@ -97,101 +366,554 @@ private:
 //
 //
 
-template <class T>
-PointCloud<T>::~PointCloud()
+template <class T, class Alloc>
+PointCloud<T, Alloc>::PointCloud(const Alloc& alloc)
+	: m_points(alloc)
 {
-	delete m_kdtree;
+}
+
+template <class T, class Alloc>
+PointCloud<T, Alloc>::~PointCloud()
+{
+	Node<T, Alloc>::destroy(m_kdtree);
 	m_kdtree = 0;
 }
 
-template <class T>
-void PointCloud<T>::rebuildTree()
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::rebuildTree()
+{
+	rebuildTree(nullptr, 0);
+}
+
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::rebuildTree(const float* querySample, uint64_t count)
+{
+	KDTREE_MEASURE_LATENCY(RebuildTree);
+	KDTREE_TRACE("rebuildTree", m_points.size());
+
+	{
+		KDTREE_TRACE("destroy", m_points.size());
+		Node<T, Alloc>::destroy(m_kdtree);
+		m_kdtree = nullptr;
+	}
+
+	{
+		KDTREE_TRACE("allocate", m_points.size());
+		if (m_hugePages) {
+			if (!m_nodePool) {
+				m_nodePool.reset(new HugePagePool<Node<T, Alloc>>());
+			}
+			adviseHugePages(m_points.data(), m_points.capacity() * sizeof(T));
+		} else {
+			m_nodePool.reset();
+		}
+	}
+
+	if (count > 0 && !m_points.empty())
+	{
+		QuerySample sample;
+		sample.queries.resize(count);
+		for (uint64_t i = 0; i < count; ++i) {
+			sample.queries[i] = {querySample[3 * i], querySample[3 * i + 1], querySample[3 * i + 2]};
+		}
+		sample.density = static_cast<float>(count) / m_points.size();
+
+		m_kdtree = Node<T, Alloc>::create(m_points, 0, m_points.size(), m_nodePool.get(), sample, 0, count);
+		m_buildCost = relativeCost(m_kdtree->cost());
+		m_buildCostStale = false;
+		return;
+	}
+
+	m_kdtree = Node<T, Alloc>::create(m_points, 0, m_points.size(), m_nodePool.get(), m_lazyBuild);
+
+	// the cost of a lazy tree only grows as it is expanded
+	m_buildCost = m_lazyBuild ? 0.0 : relativeCost(m_kdtree->cost());
+	m_buildCostStale = false;
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::refit()
 {
-	if (m_kdtree) {
-		delete m_kdtree;
+	float degradation;
+	return refit(degradation);
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::refit(float& degradation)
+{
+	degradation = 1.0f;
+	if (!m_kdtree) {
+		return false;
 	}
 
-	m_kdtree = new kdtree::Node<T>(m_points, 0, m_points.size());
+	// one asynchronous subtree per level, i.e. about one task per core
+	unsigned int parallel = 0;
+	while ((2u << parallel) <= std::thread::hardware_concurrency()) {
+		++parallel;
+	}
+
+	KDTREE_TRACE("refit tree", m_points.size());
+
+	// the boxes still describe the tree after the last insertions
+	if (m_buildCostStale && !m_lazyBuild) {
+		m_buildCost = relativeCost(m_kdtree->cost());
+	}
+	m_buildCostStale = false;
+
+	// tiny subtrees are not worth a thread
+	const double cost = m_kdtree->refit(m_points.size() >= 100000 ? parallel : 0);
+	if (m_buildCost > 0.0) {
+		degradation = static_cast<float>(relativeCost(cost) / m_buildCost);
+	}
+	return true;
+}
+
+template <class T, class Alloc>
+double PointCloud<T, Alloc>::relativeCost(double cost) const
+{
+	const double area = m_kdtree->box.surfaceArea();
+	return area > 0.0 ? cost / area : 0.0;
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findKNearest(const float* p, unsigned int k, std::vector<T>& result) const
+{
+	std::vector<float> distances;
+	return findKNearest(p, k, result, distances);
 }
 
-template <class T>
-bool PointCloud<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result)
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const
 {
+	KDTREE_MEASURE_LATENCY(FindKNearest);
+
+	if (m_recorder) {
+		m_recorder->recordKNearest(p, k);
+	}
+
 	result.clear();
+	distances.clear();
 	
 	if (!m_kdtree) {
 		return false;
 	}
 
-	if (k >= m_points.size())
+	// a lazy tree may still reorder points, so traverse it to expand it
+	if (k >= m_points.size() && !m_lazyBuild)
 	{
+		// all points, sorted by distance
 		result.assign(m_points.begin(), m_points.end());
-		std::nth_element(result.begin(),
-						 result.end(),
-						 result.end(),
-						 T::smaller_dist);
+		distances.resize(result.size());
+		for (uint64_t i = 0; i < result.size(); ++i) {
+			distances[i] = pointDistance2(result[i], p);
+			setDistance(result[i], distances[i]);
+		}
+		sortNearest(result, distances);
 	}
 	else if (k > 0)
 	{
-		kdtree::Node<T>::dist = 100000000.0f;
-		m_kdtree->findKNearest(p, k, result);
+		float bound = std::numeric_limits<float>::max();
+		m_kdtree->findKNearest(p, static_cast<unsigned int>(std::min<uint64_t>(k, m_points.size())), result, distances, bound);
 	}
 	
 	return true;
 }
 
-template <class T>
-bool PointCloud<T>::findInRadius(const float* m, float radius2, std::vector<T>& result)
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findInRadius(const float* m, float radius2, std::vector<T>& result) const
+{
+	std::vector<float> distances;
+	return findInRadius(m, radius2, result, distances);
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const
 {
+	KDTREE_MEASURE_LATENCY(FindInRadius);
+
+	if (m_recorder) {
+		m_recorder->recordInRadius(m, radius2);
+	}
+
 	if (!m_kdtree) {
 		return false;
 	}
 
 	result.clear();
-	m_kdtree->findInRadius(m, radius2, result);
+	distances.clear();
+	m_kdtree->findInRadius(m, radius2, result, distances);
+	return true;
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results) const
+{
+	std::vector<std::vector<float>> distances;
+	return findInRadius(queries, count, radius2, results, distances);
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findInRadius(const float* queries, uint64_t count, float radius2, std::vector<std::vector<T>>& results,
+										std::vector<std::vector<float>>& distances) const
+{
+	KDTREE_MEASURE_LATENCY(FindInRadiusBatch);
+	KDTREE_TRACE("findInRadius batch", count);
+
+	for (uint64_t q = 0; m_recorder && q < count; ++q) {
+		m_recorder->recordInRadius(queries + 3 * q, radius2);
+	}
+
+	results.resize(count);
+	distances.resize(count);
+	for (uint64_t q = 0; q < count; ++q) {
+		results[q].clear();
+		distances[q].clear();
+	}
+
+	if (!m_kdtree) {
+		return false;
+	}
+
+	for (uint64_t first = 0; first < count; first += QueryPacket::size)
+	{
+		QueryPacket packet;
+		packet.set(queries, first, count);
+
+		uint32_t active = 0;
+		for (unsigned int j = 0; j < packet.count; ++j)
+		{
+			const float m[3] = {packet.x[j], packet.y[j], packet.z[j]};
+			if (m_kdtree->box.distance2(m) <= radius2)
+				active |= 1u << j;
+		}
+
+		if (active)
+			m_kdtree->findInRadius(packet, active, radius2, results, distances);
+	}
+
+	return true;
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findNearest(const float* queries, uint64_t count, std::vector<T>& result) const
+{
+	std::vector<float> distances;
+	return findNearest(queries, count, result, distances);
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::findNearest(const float* queries, uint64_t count, std::vector<T>& result, std::vector<float>& distances) const
+{
+	KDTREE_MEASURE_LATENCY(FindNearestBatch);
+	KDTREE_TRACE("findNearest batch", count);
+
+	for (uint64_t q = 0; m_recorder && q < count; ++q) {
+		m_recorder->recordKNearest(queries + 3 * q, 1);
+	}
+
+	result.clear();
+	distances.clear();
+
+	if (!m_kdtree) {
+		return false;
+	}
+
+	if (m_points.empty()) {
+		return true;
+	}
+
+	result.reserve(count);
+	distances.reserve(count);
+	std::vector<T> single;
+	std::vector<float> singleDistances;
+	for (uint64_t first = 0; first < count; first += QueryPacket::size)
+	{
+		QueryPacket packet;
+		packet.set(queries, first, count);
+
+		// the leaf of each query. Queries in more than a few leaves are not
+		// coherent, their packet would scan each leaf for all queries, so
+		// they search one at a time.
+		const Node<T, Alloc>* leaves[maxPacketLeaves];
+		unsigned int leafCount = 0;
+		for (unsigned int j = 0; j < packet.count; ++j)
+		{
+			const float m[3] = {packet.x[j], packet.y[j], packet.z[j]};
+			if (leafCount && leaves[leafCount - 1]->box.distance2(m) == 0.0f)
+				continue;
+
+			const Node<T, Alloc>* node = m_kdtree;
+			for (node->expand(); !node->isLeaf(); node->expand()) {
+				node = node->left->box.distance2(m) <= node->right->box.distance2(m) ? node->left : node->right;
+			}
+
+			if (std::find(leaves, leaves + leafCount, node) != leaves + leafCount)
+				continue;
+			if (leafCount == maxPacketLeaves) {
+				++leafCount;
+				break;
+			}
+			leaves[leafCount++] = node;
+		}
+
+		if (leafCount > maxPacketLeaves)
+		{
+			for (unsigned int j = 0; j < packet.count; ++j)
+			{
+				float bound = std::numeric_limits<float>::max();
+				single.clear();
+				singleDistances.clear();
+				m_kdtree->findKNearest(queries + 3 * (first + j), 1, single, singleDistances, bound);
+				result.push_back(single[0]);
+				distances.push_back(singleDistances[0]);
+			}
+			continue;
+		}
+
+		float best2[QueryPacket::size];
+		uint64_t nearest[QueryPacket::size];
+		std::fill(best2, best2 + QueryPacket::size, std::numeric_limits<float>::max());
+		std::fill(nearest, nearest + QueryPacket::size, 0);
+
+		// start with the leaves of the queries, so queries far from the
+		// center of the packet do not search with an unbounded distance
+		for (unsigned int l = 0; l < leafCount; ++l) {
+			leaves[l]->findNearest(packet, 0, best2, nearest);
+		}
+
+		const uint32_t active = (1u << packet.count) - 1;
+		m_kdtree->findNearest(packet, active, best2, nearest);
+
+		for (unsigned int j = 0; j < packet.count; ++j)
+		{
+			result.push_back(m_points[nearest[j]]);
+			setDistance(result.back(), best2[j]);
+			distances.push_back(best2[j]);
+		}
+	}
+
+	return true;
+}
+
+template <class T, class Alloc>
+template <class Visitor>
+bool PointCloud<T, Alloc>::visitInRadius(const float* m, float radius2, Visitor&& visitor) const
+{
+	if (!m_kdtree) {
+		return false;
+	}
+
+	m_kdtree->visitInRadius(m, radius2, visitor);
 	return true;
 }
 
-template <class T>
-void PointCloud<T>::clear()
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::anyWithinRadius(const float* m, float radius2) const
 {
-	delete m_kdtree;
+	uint64_t index;
+	return firstWithinRadius(m, radius2, index);
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::firstWithinRadius(const float* m, float radius2, uint64_t& index) const
+{
+	if (!m_kdtree || m_kdtree->box.distance2(m) > radius2) {
+		return false;
+	}
+
+	bool found = false;
+	m_kdtree->visitInRadius(m, radius2, [&](uint64_t i, float) {
+		index = i;
+		found = true;
+		return false;
+	});
+	return found;
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::anyWithinRadius(const float* queries, uint64_t count, float radius2, std::vector<bool>& hits) const
+{
+	KDTREE_MEASURE_LATENCY(AnyWithinRadiusBatch);
+	KDTREE_TRACE("anyWithinRadius batch", count);
+
+	hits.assign(count, false);
+
+	if (!m_kdtree) {
+		return false;
+	}
+
+	bool lastValid = false;
+	uint64_t last = 0;
+	for (uint64_t q = 0; q < count; ++q)
+	{
+		const float* m = queries + 3 * q;
+		if (lastValid && pointDistance2(m_points[last], m) <= radius2) {
+			hits[q] = true;
+		} else if (firstWithinRadius(m, radius2, last)) {
+			hits[q] = true;
+			lastValid = true;
+		}
+	}
+
+	return true;
+}
+
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::clear()
+{
+	Node<T, Alloc>::destroy(m_kdtree);
 	m_kdtree = 0;
 	
 	m_points.clear();
 }
 
-template <class T>
-void PointCloud<T>::setItems(const std::vector <T>& items)
+template <class T, class Alloc>
+template <class ItemAlloc>
+void PointCloud<T, Alloc>::setItems(const std::vector <T, ItemAlloc>& items)
 {
 	clear();
-	m_points = items;
+	m_points.assign(items.begin(), items.end());
 }
 
-template <class T>
-void PointCloud<T>::addItems(const std::vector <T>& items)
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::setItems(std::vector <T, Alloc>&& items)
 {
-	delete m_kdtree;
+	clear();
+	m_points = std::move(items);
+}
+
+template <class T, class Alloc>
+template <class ItemAlloc>
+void PointCloud<T, Alloc>::addItems(const std::vector <T, ItemAlloc>& items)
+{
+	Node<T, Alloc>::destroy(m_kdtree);
 	m_kdtree = 0;
 
 	m_points.insert(m_points.end(), items.begin(), items.end());
 }
 
-template <class T>
-void PointCloud<T>::addItem(const T& item)
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::addItem(const T& item)
 {
-	delete m_kdtree;
+	Node<T, Alloc>::destroy(m_kdtree);
 	m_kdtree = 0;
 
 	m_points.push_back(item);
 }
 
-template <class T>
-const std::vector <T>& PointCloud<T>::points() const
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::insertItem(const T& item)
+{
+	if (!m_kdtree) {
+		m_points.push_back(item);
+		return;
+	}
+
+	m_kdtree->insert(item);
+	m_buildCostStale = true;
+
+	// the inserted points are scattered over the end of the point vector,
+	// copying them into tree order after each doubling costs O(1) amortized
+	if (m_kdtree->inserted() > m_points.size() - m_kdtree->inserted()) {
+		compact();
+	}
+}
+
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::compact()
+{
+	if (!m_kdtree || !m_kdtree->inserted()) {
+		return;
+	}
+
+	KDTREE_TRACE("compact", m_points.size());
+	std::vector<T, Alloc> points(m_points.get_allocator());
+	points.reserve(m_points.capacity());
+	m_kdtree->compact(m_points, points);
+
+	// the nodes refer to m_points, so keep the vector and swap its storage
+	m_points.swap(points);
+	if (m_hugePages) {
+		adviseHugePages(m_points.data(), m_points.capacity() * sizeof(T));
+	}
+}
+
+template <class T, class Alloc>
+T* PointCloud<T, Alloc>::pointData()
+{
+	return m_points.data();
+}
+
+template <class T, class Alloc>
+const std::vector <T, Alloc>& PointCloud<T, Alloc>::points() const
 {
 	return m_points;
 }
 
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::flatten(std::vector<FlatNode>& nodes) const
+{
+	nodes.clear();
+
+	if (!m_kdtree || m_kdtree->inserted()) {
+		return false;
+	}
+
+	flatten(m_kdtree, nodes);
+	return true;
+}
+
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::flatten(const Node<T, Alloc>* node, std::vector<FlatNode>& nodes)
+{
+	const size_t index = nodes.size();
+	node->expand();
+	nodes.push_back(FlatNode{BoundingBox<Point>(node->box), node->m_begin, node->m_end, 0, 0});
+
+	if (!node->isLeaf())
+	{
+		flatten(node->left, nodes);
+		nodes[index].right = static_cast<uint32_t>(nodes.size());
+		flatten(node->right, nodes);
+	}
+}
+
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::setHugePages(bool enable)
+{
+	m_hugePages = enable;
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::hugePages() const
+{
+	return m_hugePages;
+}
+
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::setLazyBuild(bool enable)
+{
+	m_lazyBuild = enable;
+}
+
+template <class T, class Alloc>
+bool PointCloud<T, Alloc>::lazyBuild() const
+{
+	return m_lazyBuild;
+}
+
+template <class T, class Alloc>
+void PointCloud<T, Alloc>::setQueryRecorder(QueryRecorder* recorder)
+{
+	m_recorder = recorder;
+}
+
+template <class T, class Alloc>
+QueryRecorder* PointCloud<T, Alloc>::queryRecorder() const
+{
+	return m_recorder;
+}
+
 }
 
 #endif // KDTREE_POINTCLOUD_H
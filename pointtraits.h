@@ -0,0 +1,127 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_POINTTRAITS_H
+#define KDTREE_POINTTRAITS_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#ifdef __cpp_concepts
+#include <concepts>
+#endif
+
+namespace kdtree
+{
+
+/**
+ * The struct @p PointTraits tells the kdtree how to access the coordinates
+ * of a point type @p T. By default, the coordinates are read from the member
+ * array @p p, as in @p SlimPoint.
+ *
+ * Specialize it to use existing point types without converting them, e.g.
+ * @code
+ * template <>
+ * struct kdtree::PointTraits<Eigen::Vector3f>
+ * {
+ *     static float coordinate(const Eigen::Vector3f& point, int axis) { return point[axis]; }
+ * };
+ * @endcode
+ * A specialization may also provide
+ * - static float distance2(const T& point, const float* x): square distance
+ *   to @p x, optimized for the memory layout of @p T.
+ * - static T create(float x, float y, float z): constructs a point, which
+ *   is only needed by CompressedPointCloud.
+ */
+template <class T>
+struct PointTraits
+{
+	template <class U = T>
+	static auto coordinate(const U& point, int axis) -> decltype(static_cast<float>(point.p[axis]))
+	{
+		return point.p[axis];
+	}
+};
+
+/**
+ * Returns the coordinate of @p point along @p axis (0, 1 or 2).
+ */
+template <class T>
+inline float pointCoordinate(const T& point, int axis)
+{
+	return PointTraits<T>::coordinate(point, axis);
+}
+
+template <class T>
+inline auto traitsDistance2(const T& point, const float* x, int) -> decltype(static_cast<float>(PointTraits<T>::distance2(point, x)))
+{
+	return PointTraits<T>::distance2(point, x);
+}
+
+template <class T>
+inline auto traitsDistance2(const T& point, const float* x, long) -> decltype(static_cast<float>(point.distance2(x)))
+{
+	return point.distance2(x);
+}
+
+template <class T>
+inline float traitsDistance2(const T& point, const float* x, ...)
+{
+	const float dx = x[0] - pointCoordinate(point, 0);
+	const float dy = x[1] - pointCoordinate(point, 1);
+	const float dz = x[2] - pointCoordinate(point, 2);
+	return dx * dx + dy * dy + dz * dz;
+}
+
+/**
+ * Returns the square distance of @p point to @p x. Uses, in this order,
+ * PointTraits<T>::distance2(), the member function T::distance2(), or the
+ * coordinates.
+ */
+template <class T>
+inline float pointDistance2(const T& point, const float* x)
+{
+	return traitsDistance2(point, x, 0);
+}
+
+template <class T>
+inline auto traitsCreate(float x, float y, float z, int) -> decltype(PointTraits<T>::create(x, y, z))
+{
+	return PointTraits<T>::create(x, y, z);
+}
+
+template <class T>
+inline T traitsCreate(float x, float y, float z, long)
+{
+	return T(x, y, z);
+}
+
+/**
+ * Returns a point with the coordinates @p x, @p y and @p z. Uses
+ * PointTraits<T>::create() if available, otherwise the constructor T(x, y, z).
+ */
+template <class T>
+inline T makePoint(float x, float y, float z)
+{
+	return traitsCreate<T>(x, y, z, 0);
+}
+
+#ifdef __cpp_concepts
+/**
+ * The concept @p SpatialPoint is satisfied by all point types the kdtree can
+ * store: copyable types with coordinate access through @p PointTraits.
+ */
+template <class T>
+concept SpatialPoint = std::copy_constructible<T> && requires(const T& point, int axis)
+{
+	{ PointTraits<T>::coordinate(point, axis) } -> std::convertible_to<float>;
+};
+#endif
+
+}
+
+#endif // KDTREE_POINTTRAITS_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -0,0 +1,61 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_QUERYCOUNTERS_H
+#define KDTREE_QUERYCOUNTERS_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <cstdint> // uint64_t
+
+namespace kdtree
+{
+
+/**
+ * The struct @p QueryCounters counts the work of the single point queries
+ * findKNearest() and findInRadius() of a PointCloud: the leaves they visit
+ * and the points they scan in these leaves. The counts are only collected if
+ * the library is compiled with KDTREE_QUERY_COUNTERS defined.
+ *
+ * Each thread has its own counters, so counting needs no synchronization.
+ * To measure a set of queries, compare the counters of the querying thread
+ * before and after.
+ */
+struct QueryCounters
+{
+	uint64_t leaves = 0;	///< visited leaves
+	uint64_t points = 0;	///< points scanned in the visited leaves
+};
+
+/**
+ * Returns the counters of the calling thread.
+ */
+inline QueryCounters& queryCounters();
+
+#ifdef KDTREE_QUERY_COUNTERS
+#define KDTREE_COUNT_LEAF(size) (++kdtree::queryCounters().leaves, kdtree::queryCounters().points += (size))
+#else
+#define KDTREE_COUNT_LEAF(size)
+#endif
+
+
+//
+//
+// IMPLEMENTATION
+//
+//
+
+inline QueryCounters& queryCounters()
+{
+	static thread_local QueryCounters counters;
+	return counters;
+}
+
+}
+
+#endif // KDTREE_QUERYCOUNTERS_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -0,0 +1,285 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_QUERYLOG_H
+#define KDTREE_QUERYLOG_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <cstring> // std::memcmp
+#include <cstdint> // uint64_t
+
+namespace kdtree
+{
+
+/**
+ * The struct @p QueryRecord stores the parameters of one query in a query log.
+ */
+struct QueryRecord
+{
+	enum Type : uint32_t {
+		KNearest = 0,	///< findKNearest(p, k)
+		InRadius = 1	///< findInRadius(p, radius2)
+	};
+
+	float p[3];			///< reference point or center of the sphere
+	float radius2;		///< square radius for InRadius, 0 otherwise
+	uint32_t k;			///< amount of points for KNearest, 0 otherwise
+	uint32_t type;		///< the @p Type of the query
+};
+
+static_assert(sizeof(QueryRecord) == 24, "QueryRecord must have a fixed size");
+
+/**
+ * The struct @p QueryLogHeader starts a query log file, followed by the
+ * @p QueryRecord entries up to the end of the file.
+ */
+struct QueryLogHeader
+{
+	char magic[8];			///< "KDQUERY" followed by a 0 byte
+	uint32_t version;		///< version of the log layout
+	uint32_t byteOrder;		///< @p queryLogByteOrder in the byte order of the writer
+	uint32_t recordSize;	///< sizeof(QueryRecord)
+	uint32_t reserved;		///< 0
+};
+
+static_assert(sizeof(QueryLogHeader) == 24, "QueryLogHeader must have a fixed size");
+
+static constexpr char queryLogMagic[8] = {'K', 'D', 'Q', 'U', 'E', 'R', 'Y', 0};
+static constexpr uint32_t queryLogVersion = 1;
+static constexpr uint32_t queryLogByteOrder = 0x01020304;
+
+/**
+ * The class @p QueryRecorder writes the parameters of queries to a binary
+ * query log, see PointCloud::setQueryRecorder(). The log is replayed with
+ * readQueryLog() or the replay tool.
+ *
+ * Records are collected in a buffer and written in blocks, so recording
+ * costs an uncontended lock and a copy of 24 bytes per query. Several
+ * threads may record at the same time. A full buffer is swapped with an
+ * empty one under the lock and written after releasing it, so the other
+ * threads keep recording while the block is written.
+ */
+class QueryRecorder
+{
+public:
+	QueryRecorder() = default;
+	QueryRecorder(const QueryRecorder&) = delete;
+	QueryRecorder& operator=(const QueryRecorder&) = delete;
+	~QueryRecorder();
+
+	/**
+	 * Start a new log in the file @p fileName. A previously opened log is closed.
+	 * @return true on success, false if the file cannot be written.
+	 */
+	bool open(const std::string& fileName);
+
+	/**
+	 * Write all buffered records and close the log.
+	 * @return true on success, false if writing failed.
+	 */
+	bool close();
+
+	/**
+	 * Returns true, if a log is open.
+	 */
+	bool isOpen() const;
+
+	/**
+	 * Record a findKNearest() query for reference point @p p and @p k points.
+	 */
+	void recordKNearest(const float* p, unsigned int k);
+
+	/**
+	 * Record a findInRadius() query for center @p m and square radius @p radius2.
+	 */
+	void recordInRadius(const float* m, float radius2);
+
+	/**
+	 * Returns the amount of recorded queries since open().
+	 */
+	uint64_t count() const;
+
+private:
+	void record(const QueryRecord& record);
+	void write(std::vector<QueryRecord>& records);
+
+	static constexpr size_t bufferSize = 4096;
+
+	// m_mutex guards the buffer and the state, m_fileMutex the file and the
+	// block being written. m_fileMutex is taken before m_mutex is released,
+	// so the blocks are written in recording order.
+	mutable std::mutex m_mutex;
+	std::vector<QueryRecord> m_buffer;
+	uint64_t m_count = 0;
+	bool m_open = false;
+
+	std::mutex m_fileMutex;
+	std::ofstream m_file;
+	std::vector<QueryRecord> m_block;
+};
+
+/**
+ * Read the query log @p fileName written by a @p QueryRecorder.
+ * @param records returned queries in recording order
+ * @return true on success, false if the file cannot be read or is invalid.
+ */
+inline bool readQueryLog(const std::string& fileName, std::vector<QueryRecord>& records);
+
+
+//
+//
+// IMPLEMENTATION
+//
+//
+
+inline QueryRecorder::~QueryRecorder()
+{
+	close();
+}
+
+inline bool QueryRecorder::open(const std::string& fileName)
+{
+	close();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::lock_guard<std::mutex> fileLock(m_fileMutex);
+	m_file.open(fileName, std::ios::binary | std::ios::trunc);
+	if (!m_file) {
+		return false;
+	}
+
+	QueryLogHeader header;
+	std::memcpy(header.magic, queryLogMagic, sizeof(header.magic));
+	header.version = queryLogVersion;
+	header.byteOrder = queryLogByteOrder;
+	header.recordSize = sizeof(QueryRecord);
+	header.reserved = 0;
+	m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	m_buffer.reserve(bufferSize);
+	m_block.reserve(bufferSize);
+	m_count = 0;
+	m_open = true;
+	return static_cast<bool>(m_file);
+}
+
+inline bool QueryRecorder::close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::lock_guard<std::mutex> fileLock(m_fileMutex);
+	if (!m_open) {
+		return true;
+	}
+
+	write(m_buffer);
+	const bool success = static_cast<bool>(m_file.flush());
+	m_file.close();
+	m_open = false;
+	return success;
+}
+
+inline bool QueryRecorder::isOpen() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_open;
+}
+
+inline void QueryRecorder::recordKNearest(const float* p, unsigned int k)
+{
+	record(QueryRecord{{p[0], p[1], p[2]}, 0.0f, k, QueryRecord::KNearest});
+}
+
+inline void QueryRecorder::recordInRadius(const float* m, float radius2)
+{
+	record(QueryRecord{{m[0], m[1], m[2]}, radius2, 0, QueryRecord::InRadius});
+}
+
+inline uint64_t QueryRecorder::count() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_count;
+}
+
+inline void QueryRecorder::record(const QueryRecord& record)
+{
+	std::unique_lock<std::mutex> fileLock;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_open) {
+			return;
+		}
+
+		m_buffer.push_back(record);
+		++m_count;
+		if (m_buffer.size() < bufferSize) {
+			return;
+		}
+
+		// waits only if the previous block is still being written
+		fileLock = std::unique_lock<std::mutex>(m_fileMutex);
+		m_buffer.swap(m_block);
+	}
+
+	write(m_block);
+}
+
+inline void QueryRecorder::write(std::vector<QueryRecord>& records)
+{
+	m_file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(QueryRecord));
+	records.clear();
+}
+
+inline bool readQueryLog(const std::string& fileName, std::vector<QueryRecord>& records)
+{
+	records.clear();
+
+	std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+	if (!file) {
+		return false;
+	}
+
+	const std::streamoff size = file.tellg();
+	if (size < static_cast<std::streamoff>(sizeof(QueryLogHeader))) {
+		return false;
+	}
+	file.seekg(0);
+
+	QueryLogHeader header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		|| std::memcmp(header.magic, queryLogMagic, sizeof(header.magic)) != 0
+		|| header.version != queryLogVersion
+		|| header.byteOrder != queryLogByteOrder
+		|| header.recordSize != sizeof(QueryRecord)) {
+		return false;
+	}
+
+	// a truncated last record, e.g. after a crash, is dropped
+	records.resize((size - sizeof(header)) / sizeof(QueryRecord));
+	if (!file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(QueryRecord))) {
+		records.clear();
+		return false;
+	}
+
+	for (const QueryRecord& record : records) {
+		if (record.type != QueryRecord::KNearest && record.type != QueryRecord::InRadius) {
+			records.clear();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+}
+
+#endif // KDTREE_QUERYLOG_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -0,0 +1,163 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifdef WIN32
+#pragma warning(disable:4530)
+#define WIN32_CONSOLE
+#endif
+
+// Replays a query log recorded with kdtree::QueryRecorder against a cloud
+// saved with kdtree::saveFlatTree(), and reports the latency distribution.
+//
+//   replay <cloud file> <query log> [threads]
+//
+// The tree is rebuilt from the saved points with PointCloud::rebuildTree(),
+// so the queries run through the same code as in production. With several
+// threads, thread t replays the queries t, t + threads, t + 2 * threads, ...
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+
+#include "pointcloud.h"
+#include "point.h"
+#include "flattreefile.h"
+#include "querylog.h"
+#include "latency.h"
+
+// Prints percentiles of the @p latencies in nanoseconds.
+static void printLatencies(const char* name, std::vector<uint64_t>& latencies)
+{
+	if (latencies.empty()) {
+		return;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double p) {
+		return latencies[std::min<uint64_t>(latencies.size() - 1, static_cast<uint64_t>(p * latencies.size()))];
+	};
+
+	std::cout << name << latencies.size() << " queries, latency ns: "
+			  << "p50 " << percentile(0.5) << ", "
+			  << "p90 " << percentile(0.9) << ", "
+			  << "p99 " << percentile(0.99) << ", "
+			  << "p99.9 " << percentile(0.999) << ", "
+			  << "max " << latencies.back() << std::endl;
+}
+
+template <class T>
+static bool replay(const std::string& cloudFile, const std::vector<kdtree::QueryRecord>& records, unsigned int numThreads)
+{
+	std::vector<T> points;
+	{
+		kdtree::FlatTreeFile<T> file;
+		if (!file.load(cloudFile)) {
+			std::cerr << "cannot load " << cloudFile << std::endl;
+			return false;
+		}
+		points.assign(file.tree().points(), file.tree().points() + file.tree().size());
+	}
+
+	kdtree::PointCloud<T> pointCloud;
+	pointCloud.setItems(std::move(points));
+
+	auto start = std::chrono::steady_clock::now();
+	pointCloud.rebuildTree();
+	const double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << pointCloud.points().size() << " points, build " << buildTime << " s" << std::endl;
+
+	// latencies per thread and query type
+	std::vector<std::vector<uint64_t>> kNearest(numThreads);
+	std::vector<std::vector<uint64_t>> inRadius(numThreads);
+
+	auto run = [&](unsigned int t) {
+		std::vector<T> result;
+		std::vector<float> distances;
+		for (uint64_t i = t; i < records.size(); i += numThreads)
+		{
+			const kdtree::QueryRecord& record = records[i];
+			const auto begin = std::chrono::steady_clock::now();
+			if (record.type == kdtree::QueryRecord::KNearest) {
+				pointCloud.findKNearest(record.p, record.k, result, distances);
+			} else {
+				pointCloud.findInRadius(record.p, record.radius2, result, distances);
+			}
+			const auto end = std::chrono::steady_clock::now();
+
+			const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+			(record.type == kdtree::QueryRecord::KNearest ? kNearest : inRadius)[t].push_back(ns);
+		}
+	};
+
+	start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (unsigned int t = 1; t < numThreads; ++t) {
+		threads.emplace_back(run, t);
+	}
+	run(0);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	const double replayTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << records.size() << " queries, " << numThreads << " threads, "
+			  << replayTime << " s, " << records.size() / replayTime << " queries/s" << std::endl;
+
+	for (unsigned int t = 1; t < numThreads; ++t) {
+		kNearest[0].insert(kNearest[0].end(), kNearest[t].begin(), kNearest[t].end());
+		inRadius[0].insert(inRadius[0].end(), inRadius[t].begin(), inRadius[t].end());
+	}
+	printLatencies("findKNearest: ", kNearest[0]);
+	printLatencies("findInRadius: ", inRadius[0]);
+
+#ifdef KDTREE_LATENCY_HISTOGRAMS
+	// as measured by the library, including rebuildTree()
+	std::cout << kdtree::latencyHistograms().toText();
+#endif
+	return true;
+}
+
+int main( int argc, char** argv )
+{
+	if (argc < 3) {
+		std::cerr << "usage: " << argv[0] << " <cloud file> <query log> [threads]" << std::endl;
+		return 1;
+	}
+
+	const std::string cloudFile = argv[1];
+	const unsigned int numThreads = argc > 3 ? std::max(1, std::atoi(argv[3])) : 1;
+
+	std::vector<kdtree::QueryRecord> records;
+	if (!kdtree::readQueryLog(argv[2], records)) {
+		std::cerr << "cannot read query log " << argv[2] << std::endl;
+		return 1;
+	}
+
+	// the point type follows from the point size of the saved cloud
+	kdtree::FlatTreeHeader header;
+	std::ifstream file(cloudFile, std::ios::binary);
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+		std::cerr << "cannot read " << cloudFile << std::endl;
+		return 1;
+	}
+
+	bool success = false;
+	if (header.pointSize == sizeof(kdtree::SlimPoint)) {
+		success = replay<kdtree::SlimPoint>(cloudFile, records, numThreads);
+	} else if (header.pointSize == sizeof(kdtree::Point)) {
+		success = replay<kdtree::Point>(cloudFile, records, numThreads);
+	} else {
+		std::cerr << "unsupported point size " << header.pointSize << std::endl;
+	}
+
+	return success ? 0 : 1;
+}
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
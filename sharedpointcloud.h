@@ -0,0 +1,242 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_SHAREDPOINTCLOUD_H
+#define KDTREE_SHAREDPOINTCLOUD_H
+
+#include <string>
+#include <vector>
+#include <cstdint> // uint64_t
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pointcloud.h"
+#include "flattree.h"
+
+namespace kdtree
+{
+
+/**
+ * The class @p SharedPointCloud shares one static kdtree between processes
+ * via a POSIX shared memory segment.
+ *
+ * One process builds a @p PointCloud and publishes it with publish(). The
+ * segment contains a flat tree image (see writeFlatTree()), which only uses
+ * offsets, so all other processes attach() it read-only at any address and
+ * query it without building their own tree. The points must be trivially
+ * copyable.
+ */
+template <class T>
+class SharedPointCloud
+{
+public:
+	SharedPointCloud() = default;
+	SharedPointCloud(const SharedPointCloud&) = delete;
+	SharedPointCloud& operator=(const SharedPointCloud&) = delete;
+	~SharedPointCloud();
+
+	/**
+	 * Publish the point cloud @p cloud as shared memory segment @p name, e.g.
+	 * "/kdtree-map". An existing segment with the same name is replaced.
+	 * @return true on success, false if the tree is not built, points were
+	 *         inserted since the last PointCloud::compact(), or the segment
+	 *         could not be created.
+	 */
+	template <class Alloc>
+	static bool publish(const std::string& name, const PointCloud<T, Alloc>& cloud);
+
+	/**
+	 * Remove the shared memory segment @p name. Processes that attached the
+	 * segment keep their mapping until detach().
+	 */
+	static bool unlink(const std::string& name);
+
+	/**
+	 * Attach the shared memory segment @p name read-only.
+	 * @return true on success, false if the segment does not exist, is not
+	 *         completely written yet, or contains another point type.
+	 */
+	bool attach(const std::string& name);
+
+	/**
+	 * Detach from the shared memory segment.
+	 */
+	void detach();
+
+	/**
+	 * Returns true, if a segment is attached.
+	 */
+	bool isAttached() const;
+
+	/**
+	 * Find the @p k nearest points to given reference point @p p, see
+	 * PointCloud::findKNearest().
+	 * @return true on success, false if no segment is attached.
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result) const;
+	bool findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Find all points in the sphere with center @p m and @p radius, see
+	 * PointCloud::findInRadius().
+	 * @return true on success, false if no segment is attached.
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result) const;
+	bool findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Returns the tree in the shared memory segment.
+	 */
+	const FlatTreeView<T>& tree() const;
+
+private:
+	void* m_data = nullptr;
+	uint64_t m_size = 0;
+	FlatTreeView<T> m_tree;
+};
+
+
+//
+//
+// TEMPLATE IMPLEMENTATION
+//
+//
+
+template <class T>
+SharedPointCloud<T>::~SharedPointCloud()
+{
+	detach();
+}
+
+template <class T>
+template <class Alloc>
+bool SharedPointCloud<T>::publish(const std::string& name, const PointCloud<T, Alloc>& cloud)
+{
+	std::vector<FlatNode> nodes;
+	if (!cloud.flatten(nodes)) {
+		return false;
+	}
+
+	const std::vector<T, Alloc>& points = cloud.points();
+	const uint64_t size = writeFlatTree(nodes, points.data(), points.size(), nullptr);
+
+	// readers that attach while we write do not find the magic bytes yet
+	shm_unlink(name.c_str());
+	const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	writeFlatTree(nodes, points.data(), points.size(), data);
+	munmap(data, size);
+	return true;
+}
+
+template <class T>
+bool SharedPointCloud<T>::unlink(const std::string& name)
+{
+	return shm_unlink(name.c_str()) == 0;
+}
+
+template <class T>
+bool SharedPointCloud<T>::attach(const std::string& name)
+{
+	detach();
+
+	const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	if (!readFlatTree(data, info.st_size, m_tree)) {
+		munmap(data, info.st_size);
+		return false;
+	}
+
+	m_data = data;
+	m_size = info.st_size;
+	return true;
+}
+
+template <class T>
+void SharedPointCloud<T>::detach()
+{
+	if (m_data) {
+		munmap(m_data, m_size);
+	}
+
+	m_data = nullptr;
+	m_size = 0;
+	m_tree = FlatTreeView<T>();
+}
+
+template <class T>
+bool SharedPointCloud<T>::isAttached() const
+{
+	return m_data != nullptr;
+}
+
+template <class T>
+bool SharedPointCloud<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result) const
+{
+	return m_tree.findKNearest(p, k, result);
+}
+
+template <class T>
+bool SharedPointCloud<T>::findKNearest(const float* p, unsigned int k, std::vector<T>& result, std::vector<float>& distances) const
+{
+	return m_tree.findKNearest(p, k, result, distances);
+}
+
+template <class T>
+bool SharedPointCloud<T>::findInRadius(const float* m, float radius2, std::vector<T>& result) const
+{
+	return m_tree.findInRadius(m, radius2, result);
+}
+
+template <class T>
+bool SharedPointCloud<T>::findInRadius(const float* m, float radius2, std::vector<T>& result, std::vector<float>& distances) const
+{
+	return m_tree.findInRadius(m, radius2, result, distances);
+}
+
+template <class T>
+const FlatTreeView<T>& SharedPointCloud<T>::tree() const
+{
+	return m_tree;
+}
+
+}
+
+#endif // KDTREE_SHAREDPOINTCLOUD_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
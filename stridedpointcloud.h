@@ -0,0 +1,323 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_STRIDEDPOINTCLOUD_H
+#define KDTREE_STRIDEDPOINTCLOUD_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstdint> // uint32_t, uint64_t
+
+#include "point.h"
+#include "boundingbox.h"
+#include "neighbors.h"
+
+namespace kdtree
+{
+
+/**
+ * The class @p StridedPointCloud is a kdtree over point data owned by someone
+ * else, for instance an interleaved sensor buffer or an Eigen matrix.
+ *
+ * The i-th point consists of the three floats at byte offset i * stride from
+ * the base pointer. The tree sorts a permutation of point indices instead of
+ * the points, so the external buffer is never copied or reordered. It must
+ * stay valid and unchanged as long as the tree is used.
+ *
+ * Queries return indices into the external buffer.
+ */
+class StridedPointCloud
+{
+public:
+	StridedPointCloud() = default;
+
+	/**
+	 * Constructor that calls setBuffer().
+	 */
+	StridedPointCloud(const float* base, uint64_t stride, uint64_t count);
+
+	/**
+	 * Set the external point buffer. The old tree is removed.
+	 * @param base pointer to the coordinates x/y/z of the first point
+	 * @param stride distance in bytes between two points, e.g. 12 for packed xyz
+	 * @param count amount of points
+	 * @note Call rebuildTree() afterwards.
+	 */
+	void setBuffer(const float* base, uint64_t stride, uint64_t count);
+
+	/**
+	 * Create the KdTree structure of the current buffer.
+	 * @note Call this function whenever the buffer content changed.
+	 */
+	void rebuildTree();
+
+	/**
+	 * Find the @p k nearest points to given reference point @p p. The result
+	 * will be stored in the vector @p result, sorted by distance.
+	 * @param p reference point
+	 * @param k amount of points to find
+	 * @param result returned vector containing the point indices
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<uint64_t>& result) const;
+
+	/**
+	 * Like findKNearest(), but also returns the square distances of the points
+	 * in the parallel vector @p distances.
+	 */
+	bool findKNearest(const float* p, unsigned int k, std::vector<uint64_t>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Find all points in the sphere with center @p m and @p radius. The result
+	 * will be stored in the vector @p result.
+	 * @param m center of sphere
+	 * @param radius2 square radius of sphere
+	 * @param result returned vector containing the point indices
+	 * @return true on success, false if you forgot to call rebuildTree().
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<uint64_t>& result) const;
+
+	/**
+	 * Like findInRadius(), but also returns the square distances of the points
+	 * in the parallel vector @p distances.
+	 */
+	bool findInRadius(const float* m, float radius2, std::vector<uint64_t>& result, std::vector<float>& distances) const;
+
+	/**
+	 * Returns the coordinates of the point with index @p i.
+	 */
+	inline const float* point(uint64_t i) const;
+
+	/**
+	 * Returns the amount of points.
+	 */
+	uint64_t size() const;
+
+private:
+	struct StridedNode
+	{
+		BoundingBox<Point> box;	///< bounding box of all points of the node
+		uint32_t right;			///< index of the right child, the left child follows directly
+	};
+
+	void build(uint64_t begin, uint64_t end);
+
+	void findKNearest(uint32_t node, uint64_t begin, uint64_t end, const float* p, unsigned int k,
+					  std::vector<uint64_t>& result, std::vector<float>& distances, float& bound) const;
+
+	void findInRadius(uint32_t node, uint64_t begin, uint64_t end, const float* m, float radius2,
+					  std::vector<uint64_t>& result, std::vector<float>& distances) const;
+
+	/**
+	 * maximum amount of points in a leaf, see @p Node.
+	 */
+	static constexpr uint64_t N = 50;
+
+	const unsigned char* m_base = nullptr;
+	uint64_t m_stride = 0;
+	uint64_t m_count = 0;
+
+	std::vector<StridedNode> m_nodes;		///< nodes in pre-order, empty without tree
+	std::vector<uint64_t> m_permutation;	///< point indices, sorted by the tree
+};
+
+
+//
+//
+// IMPLEMENTATION
+//
+//
+
+inline StridedPointCloud::StridedPointCloud(const float* base, uint64_t stride, uint64_t count)
+{
+	setBuffer(base, stride, count);
+}
+
+inline void StridedPointCloud::setBuffer(const float* base, uint64_t stride, uint64_t count)
+{
+	m_base = reinterpret_cast<const unsigned char*>(base);
+	m_stride = stride;
+	m_count = count;
+
+	m_nodes.clear();
+	m_permutation.clear();
+}
+
+inline const float* StridedPointCloud::point(uint64_t i) const
+{
+	return reinterpret_cast<const float*>(m_base + i * m_stride);
+}
+
+inline uint64_t StridedPointCloud::size() const
+{
+	return m_count;
+}
+
+inline void StridedPointCloud::rebuildTree()
+{
+	m_nodes.clear();
+	m_permutation.resize(m_count);
+	for (uint64_t i = 0; i < m_count; ++i) {
+		m_permutation[i] = i;
+	}
+
+	if (m_count > 0) {
+		build(0, m_count);
+	} else {
+		// an empty leaf, so that queries know the tree was built
+		const float origin[3] = {0.0f, 0.0f, 0.0f};
+		m_nodes.push_back(StridedNode{BoundingBox<Point>(origin), 0});
+	}
+}
+
+inline void StridedPointCloud::build(uint64_t begin, uint64_t end)
+{
+	BoundingBox<Point> box(point(m_permutation[begin]));
+	for (uint64_t i = begin + 1; i < end; ++i) {
+		box.extend(point(m_permutation[i]));
+	}
+
+	const uint32_t index = static_cast<uint32_t>(m_nodes.size());
+	m_nodes.push_back(StridedNode{box, 0});
+
+	// split on too many points
+	if (end - begin > N)
+	{
+		const uint64_t median = begin + (end - begin) / 2;
+		const int axis = box.getSplitAxis();
+
+		std::nth_element(m_permutation.begin() + begin,
+						 m_permutation.begin() + median,
+						 m_permutation.begin() + end,
+						 [this, axis](uint64_t a, uint64_t b) {
+							 return point(a)[axis] < point(b)[axis];
+						 });
+
+		build(begin, median);
+		m_nodes[index].right = static_cast<uint32_t>(m_nodes.size());
+		build(median, end);
+	}
+}
+
+inline bool StridedPointCloud::findKNearest(const float* p, unsigned int k, std::vector<uint64_t>& result) const
+{
+	std::vector<float> distances;
+	return findKNearest(p, k, result, distances);
+}
+
+inline bool StridedPointCloud::findKNearest(const float* p, unsigned int k, std::vector<uint64_t>& result, std::vector<float>& distances) const
+{
+	result.clear();
+	distances.clear();
+
+	if (m_nodes.empty()) {
+		return false;
+	}
+
+	if (k > 0)
+	{
+		float bound = std::numeric_limits<float>::max();
+		findKNearest(0, 0, m_count, p, k, result, distances, bound);
+
+		// less than k points in the cloud
+		if (result.size() < k) {
+			sortNearest(result, distances);
+		}
+	}
+
+	return true;
+}
+
+inline void StridedPointCloud::findKNearest(uint32_t node, uint64_t begin, uint64_t end, const float* p, unsigned int k,
+											std::vector<uint64_t>& result, std::vector<float>& distances, float& bound) const
+{
+	if (m_nodes[node].right)
+	{
+		const uint64_t median = begin + (end - begin) / 2;
+		const uint32_t left = node + 1;
+		const uint32_t right = m_nodes[node].right;
+		const float tl = m_nodes[left].box.distance2(p);
+		const float tr = m_nodes[right].box.distance2(p);
+		if (tl < bound && tl < tr)
+		{
+			findKNearest(left, begin, median, p, k, result, distances, bound);
+			if (tr < bound) findKNearest(right, median, end, p, k, result, distances, bound);
+		}
+		else if (tr < bound)
+		{
+			findKNearest(right, median, end, p, k, result, distances, bound);
+			if (tl < bound) findKNearest(left, begin, median, p, k, result, distances, bound);
+		}
+		return;
+	}
+
+	for (uint64_t i = begin; i < end; ++i)
+	{
+		const float* x = point(m_permutation[i]);
+		const float d = (p[0] - x[0]) * (p[0] - x[0]) + (p[1] - x[1]) * (p[1] - x[1]) + (p[2] - x[2]) * (p[2] - x[2]);
+		if (d < bound)
+		{
+			bound = insertNearest(result, distances, k, m_permutation[i], d);
+		}
+	}
+}
+
+inline bool StridedPointCloud::findInRadius(const float* m, float radius2, std::vector<uint64_t>& result) const
+{
+	std::vector<float> distances;
+	return findInRadius(m, radius2, result, distances);
+}
+
+inline bool StridedPointCloud::findInRadius(const float* m, float radius2, std::vector<uint64_t>& result, std::vector<float>& distances) const
+{
+	result.clear();
+	distances.clear();
+
+	if (m_nodes.empty()) {
+		return false;
+	}
+
+	findInRadius(0, 0, m_count, m, radius2, result, distances);
+	return true;
+}
+
+inline void StridedPointCloud::findInRadius(uint32_t node, uint64_t begin, uint64_t end, const float* m, float radius2,
+											std::vector<uint64_t>& result, std::vector<float>& distances) const
+{
+	if (m_nodes[node].right)
+	{
+		const uint64_t median = begin + (end - begin) / 2;
+		if (m_nodes[node + 1].box.distance2(m) <= radius2)
+		{
+			findInRadius(node + 1, begin, median, m, radius2, result, distances);
+		}
+		if (m_nodes[m_nodes[node].right].box.distance2(m) <= radius2)
+		{
+			findInRadius(m_nodes[node].right, median, end, m, radius2, result, distances);
+		}
+		return;
+	}
+
+	for (uint64_t i = begin; i < end; ++i)
+	{
+		const float* x = point(m_permutation[i]);
+		const float d = (m[0] - x[0]) * (m[0] - x[0]) + (m[1] - x[1]) * (m[1] - x[1]) + (m[2] - x[2]) * (m[2] - x[2]);
+		if (d <= radius2)
+		{
+			result.push_back(m_permutation[i]);
+			distances.push_back(d);
+		}
+	}
+}
+
+}
+
+#endif // KDTREE_STRIDEDPOINTCLOUD_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
@@ -0,0 +1,196 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifndef KDTREE_TRACE_H
+#define KDTREE_TRACE_H
+
+#ifdef WIN32
+#pragma warning(disable:4530)
+#endif
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint> // uint64_t
+
+namespace kdtree
+{
+
+/**
+ * Start recording trace events of the kdtree operations, which are written
+ * to the file @p fileName by stopTrace(). The events are only recorded if
+ * the library is compiled with KDTREE_TRACING defined.
+ * @return false, if tracing is already running.
+ */
+inline bool startTrace(const std::string& fileName);
+
+/**
+ * Stop recording and write the events as Chrome trace event JSON, which can
+ * be opened in chrome://tracing or https://ui.perfetto.dev.
+ * @return true on success, false if tracing is not running or writing failed.
+ */
+inline bool stopTrace();
+
+/**
+ * Nodes of the kdtree with less points than @p traceMinPoints are not
+ * traced, otherwise a trace of a big cloud would have millions of events.
+ */
+static constexpr uint64_t traceMinPoints = 65536;
+
+/**
+ * The class @p TraceScope records a trace event from its construction to
+ * its destruction, in the timeline of the calling thread.
+ */
+class TraceScope
+{
+public:
+	/**
+	 * Start an event @p name for an operation on @p size points or queries.
+	 * No event is recorded if tracing is not running or @p size < @p minPoints.
+	 */
+	TraceScope(const char* name, uint64_t size, uint64_t minPoints = 0);
+	~TraceScope();
+
+private:
+	const char* m_name;
+	uint64_t m_size;
+	bool m_active;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+#ifdef KDTREE_TRACING
+#define KDTREE_TRACE_CONCAT2(a, b) a##b
+#define KDTREE_TRACE_CONCAT(a, b) KDTREE_TRACE_CONCAT2(a, b)
+#define KDTREE_TRACE(name, size) kdtree::TraceScope KDTREE_TRACE_CONCAT(kdtreeTraceScope, __LINE__)(name, size)
+#define KDTREE_TRACE_NODE(name, size) kdtree::TraceScope KDTREE_TRACE_CONCAT(kdtreeTraceScope, __LINE__)(name, size, kdtree::traceMinPoints)
+#else
+#define KDTREE_TRACE(name, size)
+#define KDTREE_TRACE_NODE(name, size)
+#endif
+
+
+//
+//
+// IMPLEMENTATION
+//
+//
+
+/**
+ * the events of the running trace
+ */
+struct TraceLog
+{
+	struct Event
+	{
+		const char* name;
+		uint64_t size;		///< amount of points or queries
+		uint32_t thread;
+		double start;		///< microseconds since startTrace()
+		double duration;	///< microseconds
+	};
+
+	std::atomic<bool> running{false};
+	std::mutex mutex;
+	std::string fileName;
+	std::chrono::steady_clock::time_point start;
+	std::vector<Event> events;
+
+	static TraceLog& instance()
+	{
+		static TraceLog log;
+		return log;
+	}
+
+	/**
+	 * Returns a small number for the calling thread, Chrome shows one row per thread.
+	 */
+	static uint32_t threadId()
+	{
+		static std::atomic<uint32_t> next{0};
+		static thread_local uint32_t id = next++;
+		return id;
+	}
+};
+
+inline bool startTrace(const std::string& fileName)
+{
+	TraceLog& log = TraceLog::instance();
+	std::lock_guard<std::mutex> lock(log.mutex);
+	if (log.running) {
+		return false;
+	}
+
+	log.fileName = fileName;
+	log.events.clear();
+	log.start = std::chrono::steady_clock::now();
+	log.running = true;
+	return true;
+}
+
+inline bool stopTrace()
+{
+	TraceLog& log = TraceLog::instance();
+	std::lock_guard<std::mutex> lock(log.mutex);
+	if (!log.running) {
+		return false;
+	}
+	log.running = false;
+
+	std::ofstream file(log.fileName, std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+
+	file << "{\"traceEvents\": [\n";
+	for (size_t i = 0; i < log.events.size(); ++i)
+	{
+		const TraceLog::Event& event = log.events[i];
+		file << (i ? ",\n" : "")
+			 << "{\"name\": \"" << event.name << "\", \"cat\": \"kdtree\", \"ph\": \"X\", "
+			 << "\"ts\": " << std::fixed << event.start << ", \"dur\": " << event.duration << ", "
+			 << "\"pid\": 1, \"tid\": " << event.thread << ", "
+			 << "\"args\": {\"size\": " << event.size << "}}";
+	}
+	file << "\n], \"displayTimeUnit\": \"ms\"}\n";
+
+	log.events.clear();
+	return static_cast<bool>(file.flush());
+}
+
+inline TraceScope::TraceScope(const char* name, uint64_t size, uint64_t minPoints)
+	: m_name(name)
+	, m_size(size)
+	, m_active(size >= minPoints && TraceLog::instance().running.load(std::memory_order_relaxed))
+{
+	if (m_active) {
+		m_start = std::chrono::steady_clock::now();
+	}
+}
+
+inline TraceScope::~TraceScope()
+{
+	if (!m_active) {
+		return;
+	}
+
+	const auto end = std::chrono::steady_clock::now();
+	TraceLog& log = TraceLog::instance();
+	std::lock_guard<std::mutex> lock(log.mutex);
+	if (!log.running) {
+		return;
+	}
+
+	const double start = std::chrono::duration<double, std::micro>(m_start - log.start).count();
+	const double duration = std::chrono::duration<double, std::micro>(end - m_start).count();
+	log.events.push_back(TraceLog::Event{m_name, m_size, TraceLog::threadId(), start, duration});
+}
+
+}
+
+#endif // KDTREE_TRACE_H
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;
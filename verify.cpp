@@ -0,0 +1,784 @@
+/*
+Spdx-License-Identifier: MIT
+SPDX-FileCopyrightText: 2005-2020 Dominik Haumann <dhaumann@kde.org>
+*/
+#ifdef WIN32
+#pragma warning(disable:4530)
+#define WIN32_CONSOLE
+#endif
+
+// Compares the results of all query modes with a brute force scan, see
+// bruteforce.h, on clouds of all synthetic distributions (datasets.h) and
+// an integer grid like in main.cpp, in several sizes.
+//
+//   verify [points] [queries] [seed]
+//
+// The queries are drawn from the distribution, placed exactly on points and
+// next to points, so ties and duplicates occur often. The spheres of the
+// radius queries go exactly through the k-th nearest point. Returns 0 if all
+// results are correct, 1 otherwise or on invalid arguments.
+
+#include <vector>
+#include <map>
+#include <array>
+#include <string>
+#include <functional>
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <cstdint>
+#include <cstring> // std::memcpy
+#include <cstdlib>
+#include <cstdio> // std::remove
+#include <cerrno>
+
+#include <unistd.h> // getpid
+
+#include "pointcloud.h"
+#include "point.h"
+#include "flattree.h"
+#include "flattreefile.h"
+#include "sharedpointcloud.h"
+#include "outofcorepointcloud.h"
+#include "stridedpointcloud.h"
+#include "compressedcloud.h"
+#include "datasets.h"
+#include "querylog.h"
+#include "bruteforce.h"
+
+// A reference point with the amount of points and the square radius to search.
+struct Query
+{
+	float p[3];
+	unsigned int k;
+	float radius2;
+};
+
+// Counts the checks and failures per query mode, and prints the first
+// failures of each mode.
+class Report
+{
+public:
+	void setDataset(const std::string& dataset)
+	{
+		m_dataset = dataset;
+	}
+
+	void check(const std::string& mode, bool success, uint64_t query, const std::string& detail)
+	{
+		std::pair<uint64_t, uint64_t>& counts = m_modes[mode];
+		++counts.first;
+		if (!success && counts.second++ < 5) {
+			std::cout << "FAILED " << mode << ", " << m_dataset << ", query " << query << ": " << detail << std::endl;
+		}
+	}
+
+	// Prints the checks per mode, returns true if all were successful.
+	bool summary() const
+	{
+		bool success = true;
+		for (const auto& mode : m_modes) {
+			std::cout << mode.first << ": " << mode.second.first << " checks, " << mode.second.second << " failed" << std::endl;
+			success = success && mode.second.second == 0;
+		}
+		return success;
+	}
+
+private:
+	std::string m_dataset;
+	std::map<std::string, std::pair<uint64_t, uint64_t>> m_modes;
+};
+
+// The coordinates of all points of a cloud with their multiplicity, to check
+// that results only contain points of the cloud, each at most once.
+using Coordinates = std::map<std::array<float, 3>, uint64_t>;
+
+template <class T>
+static std::array<float, 3> coordinates(const T& point)
+{
+	return {kdtree::pointCoordinate(point, 0), kdtree::pointCoordinate(point, 1), kdtree::pointCoordinate(point, 2)};
+}
+
+// Checks @p result and the optional @p distances for the reference point
+// @p p against the @p expected square distances of the brute force. If
+// @p sorted is true, the result must be sorted by distance.
+template <class T>
+static bool checkResult(const std::vector<T>& result, const std::vector<float>* distances, const float* p,
+						const std::vector<float>& expected, const Coordinates& cloud, bool sorted, std::string& detail)
+{
+	if (result.size() != expected.size()) {
+		detail = std::to_string(result.size()) + " points instead of " + std::to_string(expected.size());
+		return false;
+	}
+	if (distances && distances->size() != result.size()) {
+		detail = std::to_string(distances->size()) + " distances for " + std::to_string(result.size()) + " points";
+		return false;
+	}
+
+	std::vector<float> actual(result.size());
+	for (size_t i = 0; i < result.size(); ++i)
+	{
+		actual[i] = kdtree::pointDistance2(result[i], p);
+		if (distances && (*distances)[i] != actual[i]) {
+			detail = "distance " + std::to_string((*distances)[i]) + " of point " + std::to_string(i)
+				   + " instead of " + std::to_string(actual[i]);
+			return false;
+		}
+	}
+	if (sorted && !std::is_sorted(actual.begin(), actual.end())) {
+		detail = "not sorted by distance";
+		return false;
+	}
+
+	std::sort(actual.begin(), actual.end());
+	for (size_t i = 0; i < actual.size(); ++i) {
+		if (actual[i] != expected[i]) {
+			detail = "distance " + std::to_string(actual[i]) + " at rank " + std::to_string(i)
+				   + " instead of " + std::to_string(expected[i]);
+			return false;
+		}
+	}
+
+	Coordinates found;
+	for (const T& point : result) {
+		const auto it = cloud.find(coordinates(point));
+		if (it == cloud.end() || ++found[it->first] > it->second) {
+			detail = "point not in the cloud or returned twice";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Checks all query modes of @p pointCloud.
+template <class T>
+static void verifyPointCloud(const std::string& name, const kdtree::PointCloud<T>& pointCloud,
+							 const std::vector<Query>& queries, Report& report)
+{
+	const std::vector<T>& points = pointCloud.points();
+	Coordinates cloud;
+	for (const T& point : points) {
+		++cloud[coordinates(point)];
+	}
+
+	std::vector<T> result;
+	std::vector<float> distances;
+	std::vector<uint64_t> indices;
+	std::vector<float> expected;
+	std::string detail;
+
+	// the batch queries use one radius for all queries
+	const float batchRadius2 = queries.front().radius2;
+	std::vector<float> centers;
+	for (const Query& query : queries) {
+		centers.insert(centers.end(), query.p, query.p + 3);
+	}
+	std::vector<std::vector<T>> batchResults;
+	std::vector<std::vector<float>> batchDistances;
+	pointCloud.findInRadius(centers.data(), queries.size(), batchRadius2, batchResults, batchDistances);
+	std::vector<T> nearest;
+	std::vector<float> nearestDistances;
+	pointCloud.findNearest(centers.data(), queries.size(), nearest, nearestDistances);
+	std::vector<bool> hits;
+	pointCloud.anyWithinRadius(centers.data(), queries.size(), batchRadius2, hits);
+
+	for (uint64_t q = 0; q < queries.size(); ++q)
+	{
+		const Query& query = queries[q];
+
+		kdtree::bruteForceKNearest(points.data(), points.size(), query.p, query.k, indices, expected);
+		bool success = pointCloud.findKNearest(query.p, query.k, result, distances);
+		report.check(name + " findKNearest", success && checkResult(result, &distances, query.p, expected, cloud, true, detail), q, detail);
+		success = pointCloud.findKNearest(query.p, query.k, result);
+		report.check(name + " findKNearest without distances", success && checkResult(result, nullptr, query.p, expected, cloud, false, detail), q, detail);
+
+		kdtree::bruteForceKNearest(points.data(), points.size(), query.p, 1, indices, expected);
+		// without points there is no nearest point for any query
+		const uint64_t numNearest = points.empty() ? 0 : queries.size();
+		success = nearest.size() == numNearest && nearestDistances.size() == numNearest;
+		if (success && numNearest > 0) {
+			const std::vector<T> one = {nearest[q]};
+			const std::vector<float> oneDistance = {nearestDistances[q]};
+			success = checkResult(one, &oneDistance, query.p, expected, cloud, true, detail);
+		}
+		report.check(name + " findNearest batch", success, q, detail);
+
+		kdtree::bruteForceInRadius(points.data(), points.size(), query.p, query.radius2, indices, expected);
+		success = pointCloud.findInRadius(query.p, query.radius2, result, distances);
+		report.check(name + " findInRadius", success && checkResult(result, &distances, query.p, expected, cloud, false, detail), q, detail);
+		success = pointCloud.findInRadius(query.p, query.radius2, result);
+		report.check(name + " findInRadius without distances", success && checkResult(result, nullptr, query.p, expected, cloud, false, detail), q, detail);
+
+		std::vector<uint64_t> visited;
+		pointCloud.visitInRadius(query.p, query.radius2, [&](uint64_t index, float d) {
+			visited.push_back(index);
+			return d == kdtree::pointDistance2(points[index], query.p);
+		});
+		std::sort(visited.begin(), visited.end());
+		std::sort(indices.begin(), indices.end());
+		report.check(name + " visitInRadius", visited == indices, q, std::to_string(visited.size()) + " points visited instead of " + std::to_string(indices.size()));
+
+		uint64_t first = 0;
+		success = pointCloud.anyWithinRadius(query.p, query.radius2) == !indices.empty();
+		report.check(name + " anyWithinRadius", success, q, "wrong answer");
+		success = pointCloud.firstWithinRadius(query.p, query.radius2, first) == !indices.empty();
+		success = success && (indices.empty() || std::binary_search(indices.begin(), indices.end(), first));
+		report.check(name + " firstWithinRadius", success, q, "wrong answer or point outside the sphere");
+
+		kdtree::bruteForceInRadius(points.data(), points.size(), query.p, batchRadius2, indices, expected);
+		success = batchResults.size() == queries.size() && batchDistances.size() == queries.size();
+		report.check(name + " findInRadius batch", success && checkResult(batchResults[q], &batchDistances[q], query.p, expected, cloud, false, detail), q, detail);
+		success = hits.size() == queries.size() && hits[q] == !indices.empty();
+		report.check(name + " anyWithinRadius batch", success, q, "wrong answer");
+	}
+}
+
+// Records a mixed batch of queries on @p pointCloud, reads the log back and
+// replays it like the replay tool. The records must match the issued queries
+// field by field, and each replayed query must return the recorded distances.
+template <class T>
+static void verifyQueryLog(kdtree::PointCloud<T>& pointCloud, const std::vector<Query>& queries, Report& report)
+{
+	const std::string fileName = "kdtree-verify-" + std::to_string(getpid()) + ".log";
+	kdtree::QueryRecorder recorder;
+	if (!recorder.open(fileName)) {
+		report.check("QueryRecorder log", false, 0, "cannot write " + fileName);
+		return;
+	}
+	pointCloud.setQueryRecorder(&recorder);
+
+	std::vector<float> centers;
+	for (const Query& query : queries) {
+		centers.insert(centers.end(), query.p, query.p + 3);
+	}
+	const float batchRadius2 = queries.front().radius2;
+
+	// the issued queries and the distances of their results, in several
+	// rounds, so that the recorder writes full buffers as well
+	std::vector<kdtree::QueryRecord> issued;
+	std::vector<std::vector<float>> issuedDistances;
+	std::vector<T> result;
+	std::vector<float> distances;
+	std::vector<std::vector<T>> batchResults;
+	std::vector<std::vector<float>> batchDistances;
+	while (issued.size() <= 10000)
+	{
+		for (const Query& query : queries)
+		{
+			pointCloud.findKNearest(query.p, query.k, result, distances);
+			issued.push_back(kdtree::QueryRecord{{query.p[0], query.p[1], query.p[2]}, 0.0f, query.k, kdtree::QueryRecord::KNearest});
+			issuedDistances.push_back(distances);
+
+			pointCloud.findInRadius(query.p, query.radius2, result, distances);
+			issued.push_back(kdtree::QueryRecord{{query.p[0], query.p[1], query.p[2]}, query.radius2, 0, kdtree::QueryRecord::InRadius});
+			issuedDistances.push_back(distances);
+		}
+
+		pointCloud.findInRadius(centers.data(), queries.size(), batchRadius2, batchResults, batchDistances);
+		for (uint64_t q = 0; q < queries.size(); ++q) {
+			const float* p = queries[q].p;
+			issued.push_back(kdtree::QueryRecord{{p[0], p[1], p[2]}, batchRadius2, 0, kdtree::QueryRecord::InRadius});
+			issuedDistances.push_back(batchDistances[q]);
+		}
+
+		// the batch findNearest is recorded as findKNearest with k = 1
+		pointCloud.findNearest(centers.data(), queries.size(), result, distances);
+		for (uint64_t q = 0; q < queries.size(); ++q) {
+			const float* p = queries[q].p;
+			issued.push_back(kdtree::QueryRecord{{p[0], p[1], p[2]}, 0.0f, 1, kdtree::QueryRecord::KNearest});
+			issuedDistances.push_back(distances.empty() ? std::vector<float>() : std::vector<float>{distances[q]});
+		}
+	}
+	pointCloud.setQueryRecorder(nullptr);
+
+	const uint64_t recorded = recorder.count();
+	std::vector<kdtree::QueryRecord> records;
+	const bool success = recorder.close() && kdtree::readQueryLog(fileName, records);
+	std::remove(fileName.c_str());
+	report.check("QueryRecorder log", success && recorded == issued.size() && records.size() == issued.size(), 0,
+				 std::to_string(records.size()) + " records read for " + std::to_string(issued.size()) + " queries");
+
+	for (uint64_t i = 0; i < records.size() && i < issued.size(); ++i)
+	{
+		const kdtree::QueryRecord& record = records[i];
+		const kdtree::QueryRecord& query = issued[i];
+		const bool same = record.p[0] == query.p[0] && record.p[1] == query.p[1] && record.p[2] == query.p[2]
+						  && record.radius2 == query.radius2 && record.k == query.k && record.type == query.type;
+		report.check("QueryRecorder record", same, i, "record differs from the issued query");
+
+		if (record.type == kdtree::QueryRecord::KNearest) {
+			pointCloud.findKNearest(record.p, record.k, result, distances);
+		} else {
+			// batches may return the points of a sphere in another order
+			pointCloud.findInRadius(record.p, record.radius2, result, distances);
+			std::sort(distances.begin(), distances.end());
+			std::sort(issuedDistances[i].begin(), issuedDistances[i].end());
+		}
+		report.check("QueryRecorder replay", distances == issuedDistances[i], i,
+					 std::to_string(distances.size()) + " distances instead of the recorded " + std::to_string(issuedDistances[i].size()));
+	}
+}
+
+// A change of a valid flat tree image that makes it invalid: @p apply gets
+// the header, the nodes and the size of a copy of the image.
+struct Corruption
+{
+	std::string name;
+	bool needsInnerRoot;
+	std::function<void(kdtree::FlatTreeHeader&, kdtree::FlatNode*, uint64_t&)> apply;
+};
+
+// Checks that readFlatTree(), FlatTreeFile::load() and OutOfCorePointCloud::open()
+// reject the valid image @p image of @p size bytes after each corruption.
+template <class T>
+static void verifyCorruptImages(const std::vector<uint64_t>& image, uint64_t size, Report& report)
+{
+	kdtree::FlatTreeHeader valid;
+	std::memcpy(&valid, image.data(), sizeof(valid));
+	const kdtree::FlatNode* validNodes = reinterpret_cast<const kdtree::FlatNode*>(
+		reinterpret_cast<const unsigned char*>(image.data()) + valid.nodesOffset);
+	const bool innerRoot = valid.numNodes > 0 && validNodes[0].right != 0;
+
+	using Header = kdtree::FlatTreeHeader;
+	using Node = kdtree::FlatNode;
+	const std::vector<Corruption> corruptions = {
+		{"bad magic", false, [](Header& h, Node*, uint64_t&) { h.magic[0] = 'X'; }},
+		{"bad version", false, [](Header& h, Node*, uint64_t&) { ++h.version; }},
+		{"swapped byte order", false, [](Header& h, Node*, uint64_t&) { h.byteOrder = 0x04030201; }},
+		{"other point size", false, [](Header& h, Node*, uint64_t&) { h.pointSize += 4; }},
+		{"other node size", false, [](Header& h, Node*, uint64_t&) { h.nodeSize -= 8; }},
+		{"truncated header", false, [](Header&, Node*, uint64_t& n) { n = sizeof(Header) - 1; }},
+		{"truncated node array", false, [](Header& h, Node*, uint64_t& n) { n = h.nodesOffset + h.numNodes * sizeof(Node) - 1; }},
+		{"truncated point array", false, [](Header& h, Node*, uint64_t& n) { n = h.size - 1; }},
+		{"nodes beyond the image", false, [](Header& h, Node*, uint64_t&) { h.numNodes = (h.size - h.nodesOffset) / sizeof(Node) + 1; }},
+		{"points beyond the image", false, [](Header& h, Node*, uint64_t&) { ++h.numPoints; }},
+		{"misaligned node array", false, [](Header& h, Node*, uint64_t&) { h.nodesOffset += 4; }},
+		{"node array offset out of range", false, [](Header& h, Node*, uint64_t&) { h.nodesOffset = h.size + 64; }},
+		{"point array offset out of range", false, [](Header& h, Node*, uint64_t&) { h.pointsOffset = h.size + 64; }},
+		{"root interval beyond the points", false, [](Header& h, Node* nodes, uint64_t&) { nodes[0].end = h.numPoints + 1; }},
+		{"last leaf beyond the points", false, [](Header& h, Node* nodes, uint64_t&) { nodes[h.numNodes - 1].end = h.numPoints + 1; }},
+		{"right child out of range", true, [](Header& h, Node* nodes, uint64_t&) { nodes[0].right = static_cast<uint32_t>(h.numNodes); }},
+		{"right child is the left child", true, [](Header&, Node* nodes, uint64_t&) { nodes[0].right = 1; }},
+		{"right child inside the left subtree", true, [](Header&, Node* nodes, uint64_t&) { --nodes[0].right; }},
+		{"children swapped", true, [](Header&, Node* nodes, uint64_t&) { std::swap(nodes[1], nodes[nodes[0].right]); }},
+		{"left child interval outside its parent", true, [](Header&, Node* nodes, uint64_t&) { nodes[1].begin = nodes[0].end; }},
+	};
+
+	// which of readFlatTree(), FlatTreeFile::load() and OutOfCorePointCloud::open() accept an image
+	const std::string fileName = "kdtree-verify-" + std::to_string(getpid()) + ".corrupt";
+	const auto accepted = [&fileName](const void* data, uint64_t n) {
+		kdtree::FlatTreeView<T> view;
+		std::ofstream(fileName, std::ios::binary).write(static_cast<const char*>(data), n);
+		kdtree::FlatTreeFile<T> file;
+		kdtree::OutOfCorePointCloud<T> outOfCore;
+		return std::array<bool, 3>{kdtree::readFlatTree(data, n, view), file.load(fileName), outOfCore.open(fileName)};
+	};
+
+	// the unchanged image passes, so the rejections are due to the corruptions
+	const std::array<bool, 3> unchanged = accepted(image.data(), size);
+	report.check("corrupt image baseline", unchanged[0] && unchanged[1] && unchanged[2], 0, "valid image rejected");
+
+	for (uint64_t c = 0; c < corruptions.size(); ++c)
+	{
+		const Corruption& corruption = corruptions[c];
+		if (corruption.needsInnerRoot && !innerRoot) {
+			continue;
+		}
+
+		std::vector<uint64_t> corrupt = image;
+		unsigned char* data = reinterpret_cast<unsigned char*>(corrupt.data());
+		Header header = valid;
+		uint64_t corruptSize = size;
+		corruption.apply(header, reinterpret_cast<Node*>(data + valid.nodesOffset), corruptSize);
+		std::memcpy(data, &header, sizeof(header));
+
+		const std::array<bool, 3> result = accepted(data, corruptSize);
+		report.check("FlatTreeView corrupt image", !result[0], c, corruption.name + " accepted");
+		report.check("FlatTreeFile corrupt image", !result[1], c, corruption.name + " accepted");
+		report.check("OutOfCorePointCloud corrupt image", !result[2], c, corruption.name + " accepted");
+	}
+	std::remove(fileName.c_str());
+}
+
+// Checks the queries of a flat tree image of @p pointCloud, directly, in
+// shared memory and out of core.
+template <class T>
+static void verifyFlatTree(const kdtree::PointCloud<T>& pointCloud, const std::vector<Query>& queries, Report& report)
+{
+	const std::vector<T>& points = pointCloud.points();
+	Coordinates cloud;
+	for (const T& point : points) {
+		++cloud[coordinates(point)];
+	}
+
+	std::vector<kdtree::FlatNode> nodes;
+	pointCloud.flatten(nodes);
+	const uint64_t size = kdtree::writeFlatTree(nodes, points.data(), points.size(), nullptr);
+	std::vector<uint64_t> image((size + 7) / 8);
+	kdtree::writeFlatTree(nodes, points.data(), points.size(), image.data());
+	kdtree::FlatTreeView<T> view;
+	const bool valid = kdtree::readFlatTree(image.data(), size, view);
+	report.check("FlatTreeView image", valid, 0, "image not valid");
+	if (valid) {
+		verifyCorruptImages<T>(image, size, report);
+	}
+
+	const std::string name = "/kdtree-verify-" + std::to_string(getpid());
+	kdtree::SharedPointCloud<T> shared;
+	const bool published = kdtree::SharedPointCloud<T>::publish(name, pointCloud) && shared.attach(name);
+
+	const std::string fileName = "kdtree-verify-" + std::to_string(getpid()) + ".flat";
+	kdtree::OutOfCorePointCloud<T> outOfCore;
+	const bool opened = kdtree::saveFlatTree(fileName, pointCloud) && outOfCore.open(fileName);
+	report.check("OutOfCorePointCloud open", opened, 0, "cannot write or open " + fileName);
+
+	std::vector<T> result;
+	std::vector<float> distances;
+	std::vector<uint64_t> indices;
+	std::vector<float> expected;
+	std::string detail;
+
+	for (uint64_t q = 0; q < queries.size() && valid; ++q)
+	{
+		const Query& query = queries[q];
+
+		kdtree::bruteForceKNearest(points.data(), points.size(), query.p, query.k, indices, expected);
+		bool success = view.findKNearest(query.p, query.k, result, distances);
+		report.check("FlatTreeView findKNearest", success && checkResult(result, &distances, query.p, expected, cloud, true, detail), q, detail);
+		if (published) {
+			success = shared.findKNearest(query.p, query.k, result, distances);
+			report.check("SharedPointCloud findKNearest", success && checkResult(result, &distances, query.p, expected, cloud, true, detail), q, detail);
+		}
+
+		kdtree::bruteForceInRadius(points.data(), points.size(), query.p, query.radius2, indices, expected);
+		success = view.findInRadius(query.p, query.radius2, result, distances);
+		report.check("FlatTreeView findInRadius", success && checkResult(result, &distances, query.p, expected, cloud, false, detail), q, detail);
+		if (published) {
+			success = shared.findInRadius(query.p, query.radius2, result, distances);
+			report.check("SharedPointCloud findInRadius", success && checkResult(result, &distances, query.p, expected, cloud, false, detail), q, detail);
+		}
+	}
+
+	if (published) {
+		shared.detach();
+	}
+	kdtree::SharedPointCloud<T>::unlink(name);
+
+	// the out of core queries are batches, grouped by k
+	for (unsigned int k : {1u, queries.front().k})
+	{
+		if (!opened) {
+			break;
+		}
+
+		std::vector<float> centers;
+		for (const Query& query : queries) {
+			centers.insert(centers.end(), query.p, query.p + 3);
+		}
+
+		std::vector<std::vector<T>> results;
+		std::vector<std::vector<float>> resultDistances;
+		bool success = outOfCore.findKNearest(centers.data(), queries.size(), k, results, resultDistances);
+		for (uint64_t q = 0; q < queries.size(); ++q) {
+			kdtree::bruteForceKNearest(points.data(), points.size(), queries[q].p, k, indices, expected);
+			report.check("OutOfCorePointCloud findKNearest", success && checkResult(results[q], &resultDistances[q], queries[q].p, expected, cloud, true, detail), q, detail);
+		}
+
+		const float radius2 = queries[k == 1 ? 0 : 1].radius2;
+		success = outOfCore.findInRadius(centers.data(), queries.size(), radius2, results, resultDistances);
+		for (uint64_t q = 0; q < queries.size(); ++q) {
+			kdtree::bruteForceInRadius(points.data(), points.size(), queries[q].p, radius2, indices, expected);
+			report.check("OutOfCorePointCloud findInRadius", success && checkResult(results[q], &resultDistances[q], queries[q].p, expected, cloud, false, detail), q, detail);
+		}
+	}
+	outOfCore.close();
+	std::remove(fileName.c_str());
+}
+
+// Checks the queries of a StridedPointCloud over @p coords with padding.
+static void verifyStrided(const std::vector<float>& coords, const std::vector<Query>& queries, Report& report)
+{
+	// x, y, z and one float padding per point, like an interleaved sensor buffer
+	const uint64_t numPoints = coords.size() / 3;
+	std::vector<float> buffer(4 * numPoints);
+	std::vector<kdtree::SlimPoint> points;
+	for (uint64_t i = 0; i < numPoints; ++i) {
+		std::copy(&coords[3 * i], &coords[3 * i + 3], &buffer[4 * i]);
+		buffer[4 * i + 3] = -1.0f;
+		points.push_back(kdtree::SlimPoint(coords[3 * i], coords[3 * i + 1], coords[3 * i + 2]));
+	}
+
+	kdtree::StridedPointCloud strided(buffer.data(), 4 * sizeof(float), numPoints);
+	strided.rebuildTree();
+
+	std::vector<uint64_t> result;
+	std::vector<float> distances;
+	std::vector<uint64_t> indices;
+	std::vector<float> expected;
+
+	for (uint64_t q = 0; q < queries.size(); ++q)
+	{
+		const Query& query = queries[q];
+
+		kdtree::bruteForceKNearest(points.data(), numPoints, query.p, query.k, indices, expected);
+		bool success = strided.findKNearest(query.p, query.k, result, distances);
+		success = success && distances == expected;
+		for (size_t i = 0; success && i < result.size(); ++i) {
+			success = result[i] < numPoints && points[result[i]].distance2(query.p) == distances[i];
+		}
+		std::sort(result.begin(), result.end());
+		success = success && std::adjacent_find(result.begin(), result.end()) == result.end();
+		report.check("StridedPointCloud findKNearest", success, q, "wrong indices or distances");
+
+		kdtree::bruteForceInRadius(points.data(), numPoints, query.p, query.radius2, indices, expected);
+		success = strided.findInRadius(query.p, query.radius2, result, distances);
+		std::sort(result.begin(), result.end());
+		std::sort(indices.begin(), indices.end());
+		report.check("StridedPointCloud findInRadius", success && result == indices, q,
+					 std::to_string(result.size()) + " points instead of " + std::to_string(indices.size()));
+	}
+}
+
+// Checks the queries of a CompressedPointCloud. Since the coordinates are
+// quantized, the distances may differ by the quantization error.
+static void verifyCompressed(const std::vector<kdtree::SlimPoint>& points, const std::vector<Query>& queries, Report& report)
+{
+	kdtree::CompressedPointCloud<kdtree::SlimPoint> compressed;
+	compressed.setItems(points);
+
+	// a decoded coordinate differs by at most (extent of the leaf box) / 2046
+	float lower[3] = {0.0f, 0.0f, 0.0f};
+	if (!points.empty()) {
+		std::copy(points[0].p, points[0].p + 3, lower);
+	}
+	float upper[3] = {lower[0], lower[1], lower[2]};
+	for (const kdtree::SlimPoint& point : points) {
+		for (int i = 0; i < 3; ++i) {
+			lower[i] = std::min(lower[i], point.p[i]);
+			upper[i] = std::max(upper[i], point.p[i]);
+		}
+	}
+	const float extent = std::max({upper[0] - lower[0], upper[1] - lower[1], upper[2] - lower[2]});
+	const float error = 1.001f * std::sqrt(3.0f) * extent / 2046.0f + 1e-4f;
+
+	std::vector<kdtree::SlimPoint> result;
+	std::vector<float> distances;
+	std::vector<uint64_t> indices;
+	std::vector<float> expected;
+
+	for (uint64_t q = 0; q < queries.size(); ++q)
+	{
+		const Query& query = queries[q];
+
+		// queries on an empty compressed cloud fail, see findKNearest()
+		if (points.empty()) {
+			bool success = !compressed.findKNearest(query.p, query.k, result, distances) && result.empty();
+			report.check("CompressedPointCloud findKNearest", success, q, "empty cloud not reported");
+			success = !compressed.findInRadius(query.p, query.radius2, result, distances) && result.empty();
+			report.check("CompressedPointCloud findInRadius", success, q, "empty cloud not reported");
+			continue;
+		}
+
+		// every point moves by at most error, so does the i-th smallest distance
+		kdtree::bruteForceKNearest(points.data(), points.size(), query.p, query.k, indices, expected);
+		bool success = compressed.findKNearest(query.p, query.k, result, distances);
+		success = success && result.size() == expected.size() && distances.size() == expected.size()
+				  && std::is_sorted(distances.begin(), distances.end());
+		for (size_t i = 0; success && i < result.size(); ++i) {
+			success = std::fabs(std::sqrt(distances[i]) - std::sqrt(expected[i])) <= error
+					  && std::fabs(distances[i] - result[i].distance2(query.p)) <= 1e-3f * (1.0f + distances[i]);
+		}
+		report.check("CompressedPointCloud findKNearest", success, q, "distances off by more than the quantization error");
+
+		// points closer than radius - error are found, points farther than radius + error not
+		const float radius = std::sqrt(query.radius2);
+		const float inner = radius - error;
+		std::vector<float> outer;
+		kdtree::bruteForceInRadius(points.data(), points.size(), query.p, inner * inner, indices, expected);
+		if (inner < 0.0f) {
+			expected.clear();
+		}
+		kdtree::bruteForceInRadius(points.data(), points.size(), query.p, (radius + error) * (radius + error), indices, outer);
+		success = compressed.findInRadius(query.p, query.radius2, result, distances);
+		success = success && result.size() >= expected.size() && result.size() <= outer.size();
+		for (size_t i = 0; success && i < distances.size(); ++i) {
+			success = distances[i] <= query.radius2;
+		}
+		report.check("CompressedPointCloud findInRadius", success, q,
+					 std::to_string(result.size()) + " points, expected " + std::to_string(expected.size()) + " to " + std::to_string(outer.size()));
+	}
+}
+
+// Creates the queries for the points @p coords: a third from the distribution,
+// a third exactly on points, a third next to points.
+static std::vector<Query> createQueries(kdtree::Distribution distribution, const std::vector<float>& coords,
+										uint64_t numQueries, uint64_t seed)
+{
+	const uint64_t numPoints = coords.size() / 3;
+	std::vector<float> random(3 * numQueries);
+	kdtree::DatasetGenerator(distribution, numQueries, seed + 1).generate(0, numQueries, random.data());
+
+	std::vector<kdtree::SlimPoint> points;
+	for (uint64_t i = 0; i < coords.size(); i += 3) {
+		points.push_back(kdtree::SlimPoint(coords[i], coords[i + 1], coords[i + 2]));
+	}
+
+	// k = 0 and k >= size are included for small clouds
+	std::vector<unsigned int> ks = {1, 10, 57};
+	if (numPoints <= 1000) {
+		ks.insert(ks.end(), {0, static_cast<unsigned int>(numPoints), static_cast<unsigned int>(numPoints + 3)});
+	}
+
+	std::vector<Query> queries(numQueries);
+	std::vector<uint64_t> indices;
+	std::vector<float> distances;
+	for (uint64_t q = 0; q < numQueries; ++q)
+	{
+		Query& query = queries[q];
+		// without points, all queries come from the distribution
+		const uint64_t point = numPoints ? (q * 7919) % numPoints : 0;
+		for (int i = 0; i < 3; ++i) {
+			switch (numPoints ? q % 3 : 0) {
+				case 0: query.p[i] = random[3 * q + i]; break;
+				case 1: query.p[i] = coords[3 * point + i]; break;
+				case 2: query.p[i] = coords[3 * point + i] + (i == 0 ? 0.5f : 0.0f); break;
+			}
+		}
+		query.k = ks[(q / 3) % ks.size()];
+
+		// the sphere through the k-th nearest point, 0 if k = 0 or without points
+		kdtree::bruteForceKNearest(points.data(), points.size(), query.p, std::max(1u, query.k), indices, distances);
+		query.radius2 = query.k && !distances.empty() ? distances.back() : 0.0f;
+	}
+	return queries;
+}
+
+// Parses the decimal number @p text into @p value, false if it is anything else.
+static bool parseNumber(const char* text, uint64_t& value)
+{
+	if (*text < '0' || *text > '9') {
+		return false;
+	}
+	char* end = nullptr;
+	errno = 0;
+	value = std::strtoull(text, &end, 10);
+	return *end == '\0' && errno == 0;
+}
+
+int main( int argc, char** argv )
+{
+	uint64_t maxPoints = 20000;
+	uint64_t numQueries = 300;
+	uint64_t seed = 42;
+	if (argc > 4
+		|| (argc > 1 && !parseNumber(argv[1], maxPoints))
+		|| (argc > 2 && (!parseNumber(argv[2], numQueries) || numQueries == 0))
+		|| (argc > 3 && !parseNumber(argv[3], seed)))
+	{
+		std::cerr << "usage: " << argv[0] << " [points] [queries] [seed]" << std::endl
+				  << "defaults: 20000 points, 300 queries, seed 42" << std::endl;
+		return 1;
+	}
+
+	Report report;
+	const uint32_t numDistributions = static_cast<uint32_t>(kdtree::Distribution::DistributionCount);
+
+	// the distributions and an integer grid, the grid has the index numDistributions
+	for (uint32_t d = 0; d <= numDistributions; ++d)
+	{
+		for (uint64_t numPoints : {uint64_t(0), uint64_t(1), uint64_t(50), uint64_t(51), uint64_t(1000), maxPoints})
+		{
+			const kdtree::Distribution distribution = d < numDistributions ? static_cast<kdtree::Distribution>(d) : kdtree::Distribution::Duplicates;
+			std::vector<float> coords(3 * numPoints);
+			if (d < numDistributions) {
+				kdtree::DatasetGenerator(distribution, numPoints, seed).generate(0, numPoints, coords.data());
+			} else {
+				const uint64_t side = std::max<uint64_t>(1, std::cbrt(static_cast<double>(numPoints)));
+				for (uint64_t i = 0; i < numPoints; ++i) {
+					coords[3 * i] = i % side;
+					coords[3 * i + 1] = (i / side) % side;
+					coords[3 * i + 2] = i / (side * side);
+				}
+			}
+
+			const std::string dataset = (d < numDistributions ? kdtree::distributionName(distribution) : "grid")
+									  + std::string(", ") + std::to_string(numPoints) + " points";
+			report.setDataset(dataset);
+			std::cout << dataset << std::endl;
+
+			const std::vector<Query> queries = createQueries(distribution, coords, numQueries, seed);
+			std::vector<float> sample;
+			for (const Query& query : queries) {
+				sample.insert(sample.end(), query.p, query.p + 3);
+			}
+
+			std::vector<kdtree::Point> points;
+			std::vector<kdtree::SlimPoint> slimPoints;
+			for (uint64_t i = 0; i < coords.size(); i += 3) {
+				points.push_back(kdtree::Point(coords[i], coords[i + 1], coords[i + 2]));
+				slimPoints.push_back(kdtree::SlimPoint(coords[i], coords[i + 1], coords[i + 2]));
+			}
+
+			{
+				kdtree::PointCloud<kdtree::Point> pointCloud;
+				pointCloud.setItems(points);
+				pointCloud.rebuildTree();
+				verifyPointCloud("PointCloud", pointCloud, queries, report);
+				verifyQueryLog(pointCloud, queries, report);
+			}
+			{
+				kdtree::PointCloud<kdtree::SlimPoint> pointCloud;
+				pointCloud.setItems(slimPoints);
+				pointCloud.rebuildTree();
+				verifyPointCloud("PointCloud<SlimPoint>", pointCloud, queries, report);
+				verifyFlatTree(pointCloud, queries, report);
+			}
+			{
+				kdtree::PointCloud<kdtree::Point> pointCloud;
+				pointCloud.setLazyBuild(true);
+				pointCloud.setItems(points);
+				pointCloud.rebuildTree();
+				verifyPointCloud("lazy PointCloud", pointCloud, queries, report);
+			}
+			{
+				kdtree::PointCloud<kdtree::Point> pointCloud;
+				pointCloud.setItems(points);
+				pointCloud.rebuildTree(sample.data(), sample.size() / 3);
+				verifyPointCloud("sampled PointCloud", pointCloud, queries, report);
+			}
+			{
+				// three quarters of the points inserted into the built tree,
+				// which compacts the points once in between
+				kdtree::PointCloud<kdtree::Point> pointCloud;
+				pointCloud.setItems(std::vector<kdtree::Point>(points.begin(), points.begin() + (points.size() + 3) / 4));
+				pointCloud.rebuildTree();
+				for (uint64_t i = (points.size() + 3) / 4; i < points.size(); ++i) {
+					pointCloud.insertItem(points[i]);
+				}
+				verifyPointCloud("inserted PointCloud", pointCloud, queries, report);
+			}
+			{
+				// all points moved in place
+				kdtree::PointCloud<kdtree::Point> pointCloud;
+				pointCloud.setItems(points);
+				pointCloud.rebuildTree();
+				kdtree::Point* data = pointCloud.pointData();
+				for (uint64_t i = 0; i < points.size(); ++i) {
+					data[i].p[i % 3] += (i % 5) * 0.25f;
+				}
+				pointCloud.refit();
+				verifyPointCloud("refitted PointCloud", pointCloud, queries, report);
+			}
+
+			verifyStrided(coords, queries, report);
+			verifyCompressed(slimPoints, queries, report);
+		}
+	}
+
+	const bool success = report.summary();
+	std::cout << (success ? "all results correct" : "WRONG RESULTS") << std::endl;
+	return success ? 0 : 1;
+}
+
+// kate: indent-width 4; tab-width 4; replace-tabs off;